@@ -0,0 +1,131 @@
+# PGO training workload, run with cmake -P by the PIL_PGO build. It drives
+# the instrumented tools in TOOLS_DIR through a mix of squash, split and
+# verify work on pil-genfw images in WORK_DIR, then leaves the profiles
+# where the optimized build reads them:
+#
+#   GCC     .gcda files copied from TOOLS_DIR to the same paths in OUTPUT_DIR
+#   Clang   PROFILE_DIR/*.profraw merged into PROFDATA
+#
+# The image shapes cover the hot paths: many small segments (header
+# parsing, per-segment overhead), a few large ones (copy loops), zero-heavy
+# sparse images, ELF64 big-endian and PN_XNUM headers. Result caches and
+# layout indexes exercise SHA-256.
+
+foreach(var TOOLS_DIR WORK_DIR PROFILE_DIR OUTPUT_DIR COMPILER_ID)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "pil-pgo-train.cmake: ${var} is not set")
+    endif()
+endforeach()
+
+function(tool var name)
+    set(${var} ${TOOLS_DIR}/${name}${EXE_SUFFIX} PARENT_SCOPE)
+endfunction()
+tool(GENFW pil-genfw)
+tool(SQUASHER pil-squasher)
+tool(SPLITTER pil-splitter)
+tool(INSPECT pil-inspect)
+tool(BUNDLE pil-bundle)
+tool(INDEX pil-index)
+tool(BENCH pil-bench)
+
+# Runs a command in the current shape's directory; any failure stops the
+# build, since a profile of a failing run would train the error paths
+function(run)
+    execute_process(COMMAND ${ARGN}
+        WORKING_DIRECTORY ${dir}
+        RESULT_VARIABLE result
+        OUTPUT_QUIET
+        ERROR_VARIABLE error)
+    if(NOT result EQUAL 0)
+        string(REPLACE ";" " " command "${ARGN}")
+        message(FATAL_ERROR "PGO training step failed: ${command}\n${error}")
+    endif()
+endfunction()
+
+# Stale counts from an earlier run would be added to this one
+if(COMPILER_ID STREQUAL "GNU")
+    file(GLOB_RECURSE stale ${TOOLS_DIR}/*.gcda)
+else()
+    file(GLOB stale ${PROFILE_DIR}/*.profraw)
+endif()
+if(stale)
+    file(REMOVE ${stale})
+endif()
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR} ${PROFILE_DIR})
+
+set(shape_small --segments 400 --size 4K:64K --seed 1)
+set(shape_large --segments 4 --size 4M:16M --seed 2)
+set(shape_sparse --segments 16 --size 256K:2M --zero-fraction 0.7 --gap 64K --seed 3)
+set(shape_elf64be --elf64 --big-endian --segments 32 --size 16K:512K --seed 4)
+set(shape_xnum --xnum --segments 64 --size 4K:16K --seed 5)
+set(shapes small large sparse elf64be xnum)
+
+set(mbns "")
+foreach(shape ${shapes})
+    set(dir ${WORK_DIR}/${shape})
+    file(MAKE_DIRECTORY ${dir}/split ${dir}/sparse ${dir}/cache)
+    run(${GENFW} ${shape_${shape}} image.mbn)
+    # Bundle members are named after their file
+    configure_file(${dir}/image.mbn ${WORK_DIR}/${shape}.mbn COPYONLY)
+    list(APPEND mbns ${WORK_DIR}/${shape}.mbn)
+
+    # Split
+    run(${SPLITTER} image.mbn split/image.mdt)
+    run(${SPLITTER} --sparse --index image.mbn sparse/image.mdt)
+    run(${SPLITTER} --tar image.tar image.mbn image.mdt)
+    run(${SPLITTER} --cpio image.cpio image.mbn image.mdt)
+
+    # Squash
+    run(${SQUASHER} squashed.mbn split/image.mdt)
+    run(${SQUASHER} --sparse --index sparse.mbn sparse/image.mdt)
+    run(${SQUASHER} --simg image.simg split/image.mdt)
+    run(${SQUASHER} --tar image.tar from-tar.mbn image.mdt)
+    run(${SQUASHER} --cache cache cached.mbn split/image.mdt)
+    run(${SQUASHER} --cache cache cached.mbn split/image.mdt)
+
+    # Verify
+    foreach(output squashed.mbn sparse.mbn from-tar.mbn cached.mbn)
+        run(${CMAKE_COMMAND} -E compare_files image.mbn ${output})
+    endforeach()
+    run(${INSPECT} check image.mbn split/image.mdt sparse/image.mdt)
+    run(${INSPECT} dump --json image.mbn)
+endforeach()
+
+set(dir ${WORK_DIR})
+run(${INSPECT} check ${WORK_DIR})
+run(${INDEX} merge all.pilidx ${WORK_DIR})
+run(${INDEX} dump all.pilidx)
+run(${BUNDLE} create images.bundle ${mbns})
+file(MAKE_DIRECTORY ${WORK_DIR}/extracted)
+run(${BUNDLE} extract -j 4 images.bundle extracted)
+
+# Header decoding at its defaults, 65535 phdrs, which is the PN_XNUM path
+# (pil-bench is Linux-only)
+if(EXISTS ${BENCH})
+    run(${BENCH} micro)
+endif()
+
+if(COMPILER_ID STREQUAL "GNU")
+    file(GLOB_RECURSE profiles RELATIVE ${TOOLS_DIR} ${TOOLS_DIR}/*.gcda)
+    if(NOT profiles)
+        message(FATAL_ERROR "PGO training wrote no profiles under ${TOOLS_DIR}")
+    endif()
+    foreach(profile ${profiles})
+        get_filename_component(target_dir ${OUTPUT_DIR}/${profile} DIRECTORY)
+        file(COPY ${TOOLS_DIR}/${profile} DESTINATION ${target_dir})
+    endforeach()
+else()
+    file(GLOB profiles ${PROFILE_DIR}/*.profraw)
+    if(NOT profiles)
+        message(FATAL_ERROR "PGO training wrote no profiles under ${PROFILE_DIR}")
+    endif()
+    execute_process(COMMAND ${LLVM_PROFDATA} merge -output=${PROFDATA} ${profiles}
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "llvm-profdata merge failed")
+    endif()
+endif()
+
+# Left in place on failure for a look; a few hundred MB otherwise
+file(REMOVE_RECURSE ${WORK_DIR})
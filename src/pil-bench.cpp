@@ -0,0 +1,909 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#include "pil_bench.hpp"
+#include "pil_genfw.hpp"
+#include "pil_squash.hpp"
+#include "pil_split.hpp"
+
+#include <iostream>
+#include <filesystem>
+#include <barrier>
+#include <chrono>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+namespace pil {
+
+// Runs squash() and split() over generated images for every combination of
+// image size, segment count, I/O backend and thread count. Each combination
+// runs in a forked child, so peak RSS and I/O counters belong to it alone.
+// With N threads, N images are processed concurrently, one per thread.
+//
+// Backends: stream (plain iostreams), sparse (hole-aware), archive (tar in
+// or out; squash copies with copy_file_range).
+//
+// With --perf, the timed part is also wrapped in perf_event_open counters,
+// reported per byte so backends compare directly: low IPC with many cache
+// misses points at memory, a large kernel share of cycles at syscalls.
+
+struct Matrix {
+    std::vector<uint64_t> sizes{1 << 20, 16 << 20};
+    std::vector<size_t> segments{4, 32};
+    std::vector<size_t> threads{1};
+    std::vector<std::string> backends{"stream", "sparse", "archive"};
+    std::vector<std::string> ops{"squash", "split"};
+    size_t iterations = 5;
+    uint64_t seed = 1;
+    fs::path dir;
+    bool perf = false;
+};
+
+struct Corpus {
+    fs::path dir;
+    uint64_t image_bytes = 0;   // of the first image; the others are similar
+};
+
+auto image_name(size_t i) -> std::string {
+    return std::format("img{}", i);
+}
+
+// Equal segments adding up to size
+auto uniform_options(uint64_t size, size_t segments) -> GenOptions {
+    GenOptions options;
+    options.segments = segments;
+    options.empty_segments = 0;
+    options.min_segment_size = options.max_segment_size = std::max<uint64_t>(1, size / segments);
+    return options;
+}
+
+// Generates images from options, varying only the seed, and their mdt/bXX
+// and tar forms
+auto prepare_corpus(const Matrix& matrix, std::string_view label, GenOptions options,
+                    size_t images) -> Corpus
+{
+    Corpus corpus{matrix.dir / std::format("corpus-{}", label)};
+    fs::remove_all(corpus.dir);
+    fs::create_directories(corpus.dir);
+
+    for (size_t i = 0; i < images; ++i) {
+        options.seed = matrix.seed + i;
+
+        auto name = image_name(i);
+        auto mbn = corpus.dir / (name + ".mbn");
+        generate(mbn, options);
+        split(mbn, corpus.dir / (name + ".mdt"));
+        split_to_archive(mbn, name + ".mdt", corpus.dir / (name + ".tar"), ArchiveFormat::tar);
+
+        if (i == 0) {
+            corpus.image_bytes = fs::file_size(mbn);
+        }
+    }
+    return corpus;
+}
+
+void run_job(std::string_view op, std::string_view backend, const Corpus& corpus, size_t image,
+             const fs::path& out_dir)
+{
+    auto name = image_name(image);
+    auto in = corpus.dir / name;
+    auto out = out_dir / name;
+
+    if (op == "squash") {
+        SquashOptions options;
+        options.sparse = backend == "sparse";
+        if (backend == "archive") {
+            squash_from_archive(in.string() + ".tar", name + ".mdt", out.string() + ".mbn", options);
+        } else {
+            squash(in.string() + ".mdt", out.string() + ".mbn", options);
+        }
+    } else {
+        SplitOptions options;
+        options.sparse = backend == "sparse";
+        if (backend == "archive") {
+            split_to_archive(in.string() + ".mbn", out.string() + ".mdt", out.string() + ".tar",
+                             ArchiveFormat::tar, options);
+        } else {
+            split(in.string() + ".mbn", out.string() + ".mdt", options);
+        }
+    }
+}
+
+// One combination, run in the calling (child) process
+auto measure(const Matrix& matrix, const Corpus& corpus, std::string_view op,
+             std::string_view backend, size_t threads) -> Record
+{
+    auto out_dir = matrix.dir / std::format("out-{}", ::getpid());
+    fs::create_directories(out_dir);
+
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start, end;
+    ProcessCounters before, after;
+
+    // Opened before the workers start, so the counters follow them
+    std::optional<PerfCounters> perf;
+    if (matrix.perf) {
+        perf.emplace();
+    }
+
+    // Every thread warms up once untimed; the barriers bracket the timed part
+    std::barrier start_line(static_cast<std::ptrdiff_t>(threads), [&]() noexcept {
+        before = ProcessCounters::now();
+        if (perf) perf->start();
+        start = Clock::now();
+    });
+    std::barrier finish_line(static_cast<std::ptrdiff_t>(threads), [&]() noexcept {
+        end = Clock::now();
+        if (perf) perf->stop();
+        after = ProcessCounters::now();
+    });
+
+    std::vector<std::vector<double>> latencies(threads);
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            try {
+                run_job(op, backend, corpus, t, out_dir);
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+            start_line.arrive_and_wait();
+
+            for (size_t i = 0; i < matrix.iterations && !errors[t]; ++i) {
+                auto job_start = Clock::now();
+                try {
+                    run_job(op, backend, corpus, t, out_dir);
+                } catch (...) {
+                    errors[t] = std::current_exception();
+                }
+                latencies[t].push_back(
+                    std::chrono::duration<double, std::milli>(Clock::now() - job_start).count());
+            }
+            finish_line.arrive_and_wait();
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    fs::remove_all(out_dir);
+
+    for (const auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+
+    std::vector<double> all;
+    for (const auto& l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+
+    auto counters = after - before;
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double jobs = static_cast<double>(all.size());
+
+    Record record;
+    record.set("op", std::string(op))
+          .set("backend", std::string(backend))
+          .set("threads", static_cast<double>(threads))
+          .set("images", jobs)
+          .set("image_bytes", static_cast<double>(corpus.image_bytes))
+          .set("throughput_mbps", corpus.image_bytes * jobs / seconds / 1e6)
+          .set("p50_ms", percentile(all, 50))
+          .set("p90_ms", percentile(all, 90))
+          .set("p99_ms", percentile(all, 99))
+          .set("max_ms", percentile(all, 100))
+          .set("cpu_ms_per_image", counters.cpu_seconds * 1e3 / jobs)
+          .set("read_syscalls_per_image", counters.read_syscalls / jobs)
+          .set("write_syscalls_per_image", counters.write_syscalls / jobs)
+          .set("peak_rss_kb", static_cast<double>(after.peak_rss_kb));
+
+    if (perf) {
+        // Unavailable events leave their fields out
+        double bytes = corpus.image_bytes * jobs;
+        auto cycles = perf->value(PerfCounters::cycles);
+        auto instructions = perf->value(PerfCounters::instructions);
+        auto user_cycles = perf->value(PerfCounters::user_cycles);
+        auto misses = perf->value(PerfCounters::cache_misses);
+        auto faults = perf->value(PerfCounters::page_faults);
+        auto switches = perf->value(PerfCounters::context_switches);
+
+        if (cycles) record.set("cycles_per_byte", *cycles / bytes);
+        if (instructions) record.set("instructions_per_byte", *instructions / bytes);
+        if (cycles && instructions && *cycles > 0) record.set("ipc", *instructions / *cycles);
+        if (cycles && user_cycles && *cycles > 0 && perf->with_kernel(PerfCounters::cycles)) {
+            record.set("kernel_cycle_share", std::max(0.0, 1 - *user_cycles / *cycles));
+        }
+        if (misses) record.set("cache_misses_per_kb", *misses / (bytes / 1024));
+        if (faults) record.set("page_faults_per_mb", *faults / (bytes / (1 << 20)));
+        if (switches) record.set("context_switches_per_image", *switches / jobs);
+    }
+    return record;
+}
+
+// Runs measure() in a forked child and collects its record through a pipe
+auto measure_isolated(const Matrix& matrix, const Corpus& corpus, std::string_view op,
+                      std::string_view backend, size_t threads) -> Record
+{
+    int fds[2];
+    if (::pipe(fds) != 0) {
+        throw_system_error("Failed to create pipe");
+    }
+
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        throw_system_error("Failed to fork");
+    }
+    if (pid == 0) {
+        ::close(fds[0]);
+        std::string line;
+        try {
+            line = measure(matrix, corpus, op, backend, threads).to_json();
+        } catch (const std::exception& e) {
+            line = Record().set("error", e.what()).to_json();
+        }
+        line += '\n';
+        for (size_t done = 0; done < line.size(); ) {
+            auto n = ::write(fds[1], line.data() + done, line.size() - done);
+            if (n <= 0) break;
+            done += static_cast<size_t>(n);
+        }
+        ::_exit(0);
+    }
+
+    ::close(fds[1]);
+    std::string line;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = ::read(fds[0], buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) line.append(buffer, static_cast<size_t>(n));
+    }
+    ::close(fds[0]);
+
+    int status;
+    while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (line.empty()) {
+        throw Error(std::format("Benchmark child for {} {} died", op, backend));
+    }
+    auto record = Record::from_json(line);
+    if (auto error = record.text("error"); !error.empty()) {
+        throw Error(std::format("{} {}: {}", op, backend, error));
+    }
+    return record;
+}
+
+// Counter columns of the run table; "-" where the event was unavailable
+void print_perf(const Record& record) {
+    auto column = [&](std::string_view key, int width, int precision) {
+        if (!record.get(key)) {
+            return std::format(" {:>{}}", "-", width);
+        }
+        return std::format(" {:>{}.{}f}", record.number(key), width, precision);
+    };
+    std::cout << column("ipc", 6, 2) << column("cycles_per_byte", 7, 2)
+              << column("instructions_per_byte", 7, 2) << column("cache_misses_per_kb", 9, 2)
+              << column("page_faults_per_mb", 9, 1);
+    if (record.get("kernel_cycle_share")) {
+        std::cout << std::format(" {:>6.0f}%", record.number("kernel_cycle_share") * 100);
+    } else {
+        std::cout << std::format(" {:>7}", "-");
+    }
+}
+
+int run(const Matrix& matrix, const fs::path& output) {
+    std::vector<Record> records;
+    size_t max_threads = std::ranges::max(matrix.threads);
+
+    std::cout << std::format("{:<7} {:<8} {:>8} {:>9} {:>7} {:>10} {:>9} {:>9} {:>9} {:>10}",
+                             "op", "backend", "size", "segments", "threads", "MB/s",
+                             "p50 ms", "p99 ms", "syscalls", "RSS KiB");
+    if (matrix.perf) {
+        std::cout << std::format(" {:>6} {:>7} {:>7} {:>9} {:>9} {:>7}", "IPC", "cyc/B", "ins/B",
+                                 "miss/KiB", "fault/MiB", "kernel");
+    }
+    std::cout << '\n';
+
+    for (auto size : matrix.sizes) {
+        for (auto segments : matrix.segments) {
+            auto corpus = prepare_corpus(matrix, std::format("{}-{}", size, segments),
+                                         uniform_options(size, segments), max_threads);
+
+            for (const auto& op : matrix.ops) {
+                for (const auto& backend : matrix.backends) {
+                    for (auto threads : matrix.threads) {
+                        auto record = measure_isolated(matrix, corpus, op, backend, threads);
+                        record.set("size", static_cast<double>(size))
+                              .set("segments", static_cast<double>(segments));
+
+                        std::cout << std::format(
+                            "{:<7} {:<8} {:>8} {:>9} {:>7} {:>10.1f} {:>9.2f} {:>9.2f} {:>9.0f} {:>10}",
+                            op, backend, size, segments, threads,
+                            record.number("throughput_mbps"), record.number("p50_ms"),
+                            record.number("p99_ms"),
+                            record.number("read_syscalls_per_image") +
+                                record.number("write_syscalls_per_image"),
+                            record.number("peak_rss_kb"));
+                        if (matrix.perf) {
+                            print_perf(record);
+                        }
+                        std::cout << '\n';
+                        records.push_back(std::move(record));
+                    }
+                }
+            }
+            fs::remove_all(corpus.dir);
+        }
+    }
+
+    write_records(output, records);
+    return 0;
+}
+
+// Thread scaling: every thread count in the sweep against corpora shaped as
+// one huge segment, many small ones, or mixed sizes. Jobs are whole images,
+// so this is the scaling of concurrent squash/split calls as pil-daemon and
+// pil-bundle run them. Speedup is throughput over the single-thread
+// throughput of the same shape, efficiency is speedup per thread.
+
+constexpr std::array<std::string_view, 3> SCALE_SHAPES = {"huge", "small", "mixed"};
+constexpr uint64_t SCALE_SMALL_SEGMENT = 64 << 10;
+
+auto shape_options(std::string_view shape, uint64_t size) -> GenOptions {
+    if (shape == "huge") {
+        return uniform_options(size, 1);
+    }
+    if (shape == "small") {
+        return uniform_options(size, std::max<uint64_t>(1, size / SCALE_SMALL_SEGMENT));
+    }
+    // Log-uniform sizes, so a few large segments dominate many small ones
+    GenOptions options;
+    options.segments = 32;
+    options.empty_segments = 0;
+    options.min_segment_size = 4 << 10;
+    options.max_segment_size = std::max<uint64_t>(options.min_segment_size, size / 4);
+    return options;
+}
+
+auto default_thread_sweep() -> std::vector<size_t> {
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> threads;
+    for (size_t n = 1; n < cores; n *= 2) {
+        threads.push_back(n);
+    }
+    threads.push_back(cores);
+    return threads;
+}
+
+int scale(const Matrix& matrix, std::span<const std::string> shapes, const fs::path& output) {
+    std::vector<Record> records;
+    size_t max_threads = std::ranges::max(matrix.threads);
+
+    std::cout << std::format("{:<6} {:<7} {:<8} {:>8} {:>7} {:>10} {:>8} {:>10}\n",
+                             "shape", "op", "backend", "size", "threads", "MB/s",
+                             "speedup", "efficiency");
+
+    for (auto size : matrix.sizes) {
+        for (const auto& shape : shapes) {
+            auto corpus = prepare_corpus(matrix, std::format("{}-{}", shape, size),
+                                         shape_options(shape, size), max_threads);
+
+            for (const auto& op : matrix.ops) {
+                for (const auto& backend : matrix.backends) {
+                    double base = 0;
+                    for (auto threads : matrix.threads) {
+                        auto record = measure_isolated(matrix, corpus, op, backend, threads);
+                        double throughput = record.number("throughput_mbps");
+                        if (threads == matrix.threads.front()) {
+                            // Normalized to one thread even if the sweep starts higher
+                            base = throughput / threads;
+                        }
+                        double speedup = base > 0 ? throughput / base : 0;
+
+                        record.set("kind", "scale")
+                              .set("shape", shape)
+                              .set("size", static_cast<double>(size))
+                              .set("speedup", speedup)
+                              .set("efficiency", speedup / threads);
+
+                        std::cout << std::format("{:<6} {:<7} {:<8} {:>8} {:>7} {:>10.1f} {:>8.2f} {:>9.0f}%\n",
+                                                 shape, op, backend, size, threads, throughput,
+                                                 speedup, speedup / threads * 100);
+                        records.push_back(std::move(record));
+                    }
+                }
+            }
+            fs::remove_all(corpus.dir);
+        }
+    }
+
+    write_records(output, records);
+    return 0;
+}
+
+// Header decoding micro-benchmarks over large synthetic phdr tables, with
+// the table in host byte order ("same") and in the other one ("cross")
+
+constexpr size_t MICRO_RUNS = 7;
+
+// Decoder with the byte order fixed at compile time, pricing the runtime
+// endianness branch get_phdr_info takes for every field
+template<bool Swap, typename ElfPhdr>
+PhdrInfo<ElfPhdr> get_phdr_info_fixed(const ElfPhdr& phdr) {
+    auto convert = [](auto value) { return Swap ? byteswap(value) : value; };
+    return {convert(phdr.p_offset), convert(phdr.p_filesz), convert(phdr.p_flags)};
+}
+
+template<typename T>
+auto random_table(size_t count, uint64_t seed) -> std::vector<T> {
+    std::mt19937_64 rng(seed);
+    std::vector<T> table(count);
+    auto bytes = reinterpret_cast<uint8_t*>(table.data());
+    for (size_t i = 0; i < count * sizeof(T); ++i) {
+        bytes[i] = static_cast<uint8_t>(rng());
+    }
+    return table;
+}
+
+struct MicroResult {
+    std::string name;
+    std::string elf_class;
+    std::string endian;
+    size_t elements;
+    double ns;      // best total over elements
+};
+
+template<typename T>
+void micro_scalar(std::string_view type, size_t count, size_t repeat,
+                  std::vector<MicroResult>& results)
+{
+    auto values = random_table<T>(count, 1);
+
+    double ns = best_time_ns(MICRO_RUNS, [&] {
+        for (size_t r = 0; r < repeat; ++r) {
+            T acc = 0;
+            for (auto v : values) acc ^= byteswap(v);
+            do_not_optimize(acc);
+        }
+    });
+    results.push_back({std::format("byteswap<{}>", type), "", "", count * repeat, ns});
+
+    for (bool same : {true, false}) {
+        // volatile keeps the byte order a runtime decision, as in real use
+        volatile bool file_le = same == is_little_endian();
+        ns = best_time_ns(MICRO_RUNS, [&] {
+            for (size_t r = 0; r < repeat; ++r) {
+                bool le = file_le;
+                T acc = 0;
+                for (auto v : values) acc ^= from_file_endian(v, le);
+                do_not_optimize(acc);
+            }
+        });
+        results.push_back({std::format("from_file_endian<{}>", type), "", same ? "same" : "cross",
+                           count * repeat, ns});
+    }
+}
+
+template<typename ElfHeader, typename ElfPhdr>
+void micro_elf(std::string_view elf_class, size_t count, size_t repeat,
+               std::vector<MicroResult>& results)
+{
+    auto phdrs = random_table<ElfPhdr>(count, 2);
+
+    for (bool same : {true, false}) {
+        volatile bool file_le = same == is_little_endian();
+        std::string endian = same ? "same" : "cross";
+        auto add = [&](std::string name, size_t elements, double ns) {
+            results.push_back({std::move(name), std::string(elf_class), endian, elements, ns});
+        };
+
+        add("get_phdr_info", count * repeat, best_time_ns(MICRO_RUNS, [&] {
+            for (size_t r = 0; r < repeat; ++r) {
+                bool le = file_le;
+                for (const auto& phdr : phdrs) do_not_optimize(get_phdr_info(phdr, le));
+            }
+        }));
+
+        add("get_phdr_info_fixed", count * repeat, best_time_ns(MICRO_RUNS, [&] {
+            for (size_t r = 0; r < repeat; ++r) {
+                for (const auto& phdr : phdrs) {
+                    if (same == is_little_endian()) {
+                        do_not_optimize(get_phdr_info_fixed<!is_little_endian()>(phdr));
+                    } else {
+                        do_not_optimize(get_phdr_info_fixed<is_little_endian()>(phdr));
+                    }
+                }
+            }
+        }));
+
+        // The table as it sits in an mdt, read through an in-memory stream.
+        // From PN_XNUM entries on, the count goes into sh_info of section
+        // header 0 after the table, as pil-genfw writes it.
+        bool le = file_le;
+        bool xnum = count >= PN_XNUM;
+        size_t shoff = sizeof(ElfHeader) + count * sizeof(ElfPhdr);
+        using Addr = decltype(ElfHeader::e_phoff);
+        ElfHeader ehdr{};
+        ehdr.e_phoff = from_file_endian<Addr>(sizeof(ElfHeader), le);
+        ehdr.e_phnum = from_file_endian<uint16_t>(xnum ? PN_XNUM : static_cast<uint16_t>(count), le);
+        ElfShdr<ElfHeader> shdr{};
+        if (xnum) {
+            ehdr.e_shoff = from_file_endian<Addr>(shoff, le);
+            ehdr.e_shnum = from_file_endian<uint16_t>(1, le);
+            shdr.sh_info = from_file_endian<uint32_t>(static_cast<uint32_t>(count), le);
+        }
+        std::string image(shoff + (xnum ? sizeof(shdr) : 0), '\0');
+        std::memcpy(image.data(), &ehdr, sizeof(ehdr));
+        std::memcpy(image.data() + sizeof(ehdr), phdrs.data(), count * sizeof(ElfPhdr));
+        if (xnum) {
+            std::memcpy(image.data() + shoff, &shdr, sizeof(shdr));
+        }
+        std::istringstream stream(image);
+
+        add("read_program_headers", count, best_time_ns(MICRO_RUNS, [&] {
+            auto table = read_program_headers<ElfHeader, ElfPhdr>(stream, ehdr, file_le);
+            do_not_optimize(table.data());
+        }));
+    }
+}
+
+int micro(size_t count, size_t repeat, const fs::path& output) {
+    if (count == 0 || count > UINT32_MAX) {
+        throw Error("--phdrs must be between 1 and 4294967295");
+    }
+
+    std::vector<MicroResult> results;
+    micro_scalar<uint16_t>("u16", count * 4, repeat, results);
+    micro_scalar<uint32_t>("u32", count * 4, repeat, results);
+    micro_scalar<uint64_t>("u64", count * 4, repeat, results);
+    micro_elf<Elf32_Ehdr, Elf32_Phdr>("ELF32", count, repeat, results);
+    micro_elf<Elf64_Ehdr, Elf64_Phdr>("ELF64", count, repeat, results);
+
+    std::vector<Record> records;
+    std::cout << std::format("{:<24} {:<6} {:<6} {:>10} {:>12}\n",
+                             "benchmark", "class", "endian", "elements", "ns/element");
+    for (const auto& r : results) {
+        double per_element = r.ns / r.elements;
+        std::cout << std::format("{:<24} {:<6} {:<6} {:>10} {:>12.3f}\n",
+                                 r.name, r.elf_class, r.endian, r.elements, per_element);
+        records.push_back(Record().set("kind", "micro")
+                                  .set("name", r.name)
+                                  .set("class", r.elf_class)
+                                  .set("endian", r.endian)
+                                  .set("elements", static_cast<double>(r.elements))
+                                  .set("ns_per_element", per_element));
+    }
+
+    if (!output.empty()) {
+        write_records(output, records);
+    }
+    return 0;
+}
+
+// Stress test for images with very many segments: header parsing, split and
+// squash as phnum grows, past PN_XNUM by default. Segments are tiny, so what
+// is measured is per-segment overhead, which should stay flat per phdr.
+// Creating that many empty files is timed on its own, to show how much of
+// split is spent in the filesystem rather than in pil code.
+
+constexpr uint64_t PHNUM_SEGMENT_SIZE = 512;
+
+template<typename Body>
+double best_time_ms(size_t runs, Body&& body) {
+    return best_time_ns(runs, std::forward<Body>(body)) / 1e6;
+}
+
+int phnum_stress(const Matrix& matrix, std::span<const size_t> counts, const fs::path& output) {
+    std::vector<Record> records;
+    std::cout << std::format("{:>7} {:<5} {:>9} {:>10} {:>9} {:>10} {:>9} {:>10}\n",
+                             "phnum", "xnum", "parse ns", "split ms", "us/seg", "create ms",
+                             "squash ms", "us/seg");
+
+    for (auto count : counts) {
+        auto dir = matrix.dir / std::format("phnum-{}", count);
+        fs::remove_all(dir);
+        fs::create_directories(dir / "split");
+        fs::create_directories(dir / "create");
+
+        auto options = uniform_options(count * PHNUM_SEGMENT_SIZE, count);
+        options.zero_fraction = 0;
+        options.seed = matrix.seed;
+        auto mbn_path = dir / "img.mbn";
+        auto mdt_path = dir / "split" / "img.mdt";
+        generate(mbn_path, options);
+
+        std::ifstream mbn(mbn_path, std::ios::binary);
+        mbn.exceptions(std::ios::failbit | std::ios::badbit);
+        auto ehdr = read_elf_header<Elf32_Ehdr>(mbn);
+        size_t phnum = program_header_count(mbn, ehdr, true);
+        bool xnum = ehdr.e_phnum == PN_XNUM;
+
+        double parse_ns = best_time_ns(matrix.iterations, [&] {
+            auto header = read_elf_header<Elf32_Ehdr>(mbn);
+            auto phdrs = read_program_headers<Elf32_Ehdr, Elf32_Phdr>(mbn, header, true);
+            do_not_optimize(phdrs.data());
+        }) / phnum;
+
+        double split_ms = best_time_ms(matrix.iterations, [&] { split(mbn_path, mdt_path); });
+        double squash_ms = best_time_ms(matrix.iterations, [&] {
+            squash(mdt_path, dir / "out.mbn");
+        });
+        double create_ms = best_time_ms(matrix.iterations, [&] {
+            for (size_t i = 0; i < count; ++i) {
+                std::ofstream(dir / "create" / std::format("f{}", i), std::ios::trunc);
+            }
+        });
+        fs::remove_all(dir);
+
+        std::cout << std::format("{:>7} {:<5} {:>9.2f} {:>10.1f} {:>9.2f} {:>10.1f} {:>9.1f} {:>10.2f}\n",
+                                 phnum, xnum ? "yes" : "no", parse_ns, split_ms,
+                                 split_ms * 1e3 / count, create_ms, squash_ms,
+                                 squash_ms * 1e3 / count);
+        records.push_back(Record().set("kind", "phnum")
+                                  .set("phnum", static_cast<double>(phnum))
+                                  .set("xnum", xnum ? "yes" : "no")
+                                  .set("parse_ns_per_phdr", parse_ns)
+                                  .set("split_ms", split_ms)
+                                  .set("squash_ms", squash_ms)
+                                  .set("create_files_ms", create_ms));
+    }
+
+    if (!output.empty()) {
+        write_records(output, records);
+    }
+    return 0;
+}
+
+// Flags combinations whose throughput dropped, or whose median latency
+// rose, by more than threshold percent; scaling runs also by their
+// efficiency, micro-benchmarks by their time per element, phnum stress runs
+// by their parse, split and squash times
+int compare(const fs::path& baseline_path, const fs::path& current_path, double threshold) {
+    auto key = [](const Record& r) {
+        if (r.text("kind") == "micro") {
+            return std::format("{} {} {}", r.text("name"), r.text("class"), r.text("endian"));
+        }
+        if (r.text("kind") == "phnum") {
+            return std::format("phnum={}", r.number("phnum"));
+        }
+        if (r.text("kind") == "scale") {
+            return std::format("{} {} {} size={} threads={}", r.text("shape"), r.text("op"),
+                               r.text("backend"), r.number("size"), r.number("threads"));
+        }
+        return std::format("{} {} size={} segments={} threads={}", r.text("op"), r.text("backend"),
+                           r.number("size"), r.number("segments"), r.number("threads"));
+    };
+
+    std::map<std::string, Record> baseline;
+    for (auto& record : read_records(baseline_path)) {
+        baseline.emplace(key(record), std::move(record));
+    }
+
+    int regressions = 0;
+    for (const auto& current : read_records(current_path)) {
+        auto it = baseline.find(key(current));
+        if (it == baseline.end()) {
+            std::cout << std::format("{:<56} new\n", key(current));
+            continue;
+        }
+
+        auto change = [](double before, double now) {
+            return before > 0 ? (now - before) / before * 100 : 0.0;
+        };
+        if (current.text("kind") == "phnum") {
+            std::string line;
+            bool regressed = false;
+            for (auto field : {"parse_ns_per_phdr", "split_ms", "squash_ms"}) {
+                double time = change(it->second.number(field), current.number(field));
+                regressed = regressed || time > threshold;
+                line += std::format("  {} {:+6.1f}%", field, time);
+            }
+            regressions += regressed;
+
+            std::cout << std::format("{:<56}{}{}\n", key(current), line,
+                                     regressed ? "  REGRESSION" : "");
+            continue;
+        }
+        if (current.text("kind") == "micro") {
+            double time = change(it->second.number("ns_per_element"),
+                                 current.number("ns_per_element"));
+            bool regressed = time > threshold;
+            regressions += regressed;
+
+            std::cout << std::format("{:<56} ns/element {:+6.1f}%{}\n", key(current), time,
+                                     regressed ? "  REGRESSION" : "");
+            continue;
+        }
+
+        double throughput = change(it->second.number("throughput_mbps"),
+                                   current.number("throughput_mbps"));
+        double latency = change(it->second.number("p50_ms"), current.number("p50_ms"));
+        bool regressed = throughput < -threshold || latency > threshold;
+
+        std::string scaling;
+        if (current.text("kind") == "scale") {
+            double efficiency = change(it->second.number("efficiency"), current.number("efficiency"));
+            regressed = regressed || efficiency < -threshold;
+            scaling = std::format("  efficiency {:+6.1f}%", efficiency);
+        }
+        regressions += regressed;
+
+        std::cout << std::format("{:<56} MB/s {:+6.1f}%  p50 {:+6.1f}%{}{}\n", key(current),
+                                 throughput, latency, scaling, regressed ? "  REGRESSION" : "");
+    }
+
+    std::cout << std::format("{} regression{}\n", regressions, regressions == 1 ? "" : "s");
+    return regressions ? 1 : 0;
+}
+
+template<typename T>
+auto parse_list(std::string_view text, auto&& parse) -> std::vector<T> {
+    std::vector<T> values;
+    while (!text.empty()) {
+        auto comma = text.find(',');
+        values.push_back(parse(std::string(text.substr(0, comma))));
+        text = comma == std::string_view::npos ? std::string_view{} : text.substr(comma + 1);
+    }
+    if (values.empty()) {
+        throw Error("Empty list");
+    }
+    return values;
+}
+
+} // namespace pil
+
+int main(int argc, char* argv[]) {
+    try {
+        pil::Matrix matrix;
+        double threshold = 5;
+        size_t phdr_count = 0xffff;
+        size_t repeat = 16;
+        bool threads_given = false, sizes_given = false, backends_given = false;
+        std::vector<size_t> phnum_counts{16, 256, 4096, 65536};
+        std::vector<std::string> shapes(pil::SCALE_SHAPES.begin(), pil::SCALE_SHAPES.end());
+        std::vector<std::string_view> args;
+
+        auto as_string = [](const std::string& s) { return s; };
+        auto as_count = [](const std::string& s) { return static_cast<size_t>(std::stoul(s)); };
+
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (arg == "--perf") {
+                matrix.perf = true;
+                continue;
+            }
+            if (i + 1 >= argc) {
+                args.push_back(arg);
+                continue;
+            }
+            if (arg == "--sizes") {
+                matrix.sizes = pil::parse_list<uint64_t>(argv[++i], [](const std::string& s) {
+                    return pil::parse_size(s);
+                });
+                sizes_given = true;
+            } else if (arg == "--segments") {
+                matrix.segments = pil::parse_list<size_t>(argv[++i], as_count);
+            } else if (arg == "--threads") {
+                matrix.threads = pil::parse_list<size_t>(argv[++i], as_count);
+                threads_given = true;
+            } else if (arg == "--backends") {
+                matrix.backends = pil::parse_list<std::string>(argv[++i], as_string);
+                backends_given = true;
+            } else if (arg == "--shapes") {
+                shapes = pil::parse_list<std::string>(argv[++i], as_string);
+            } else if (arg == "--ops") {
+                matrix.ops = pil::parse_list<std::string>(argv[++i], as_string);
+            } else if (arg == "--iterations") {
+                matrix.iterations = std::max<size_t>(1, std::stoul(argv[++i]));
+            } else if (arg == "--seed") {
+                matrix.seed = std::stoull(argv[++i]);
+            } else if (arg == "--dir") {
+                matrix.dir = argv[++i];
+            } else if (arg == "--counts") {
+                phnum_counts = pil::parse_list<size_t>(argv[++i], as_count);
+            } else if (arg == "--phdrs") {
+                phdr_count = std::stoul(argv[++i]);
+            } else if (arg == "--repeat") {
+                repeat = std::max<size_t>(1, std::stoul(argv[++i]));
+            } else if (arg == "--threshold") {
+                threshold = std::stod(argv[++i]);
+            } else {
+                args.push_back(arg);
+            }
+        }
+
+        auto command = args.empty() ? std::string_view{} : args[0];
+
+        if ((command == "run" || command == "scale") && args.size() == 2) {
+            for (const auto& backend : matrix.backends) {
+                if (backend != "stream" && backend != "sparse" && backend != "archive") {
+                    throw pil::Error(std::format("Unknown backend {}", backend));
+                }
+            }
+            for (const auto& op : matrix.ops) {
+                if (op != "squash" && op != "split") {
+                    throw pil::Error(std::format("Unknown operation {}", op));
+                }
+            }
+
+            for (const auto& shape : shapes) {
+                if (std::ranges::find(pil::SCALE_SHAPES, shape) == pil::SCALE_SHAPES.end()) {
+                    throw pil::Error(std::format("Unknown shape {}", shape));
+                }
+            }
+            if (std::ranges::find(matrix.threads, 0) != matrix.threads.end()) {
+                throw pil::Error("Thread counts must be at least 1");
+            }
+            if (command == "scale") {
+                // One size and the stream backend unless asked otherwise; the
+                // sweep multiplies everything by the number of thread counts
+                if (!threads_given) matrix.threads = pil::default_thread_sweep();
+                if (!sizes_given) matrix.sizes = {16 << 20};
+                if (!backends_given) matrix.backends = {"stream"};
+            }
+
+            bool own_dir = matrix.dir.empty();
+            if (own_dir) {
+                matrix.dir = fs::temp_directory_path() / std::format("pil-bench-{}", ::getpid());
+            }
+            fs::create_directories(matrix.dir);
+            int result = command == "run" ? pil::run(matrix, args[1])
+                                          : pil::scale(matrix, shapes, args[1]);
+            if (own_dir) {
+                fs::remove_all(matrix.dir);
+            }
+            return result;
+        } else if (command == "phnum" && args.size() <= 2) {
+            if (std::ranges::find(phnum_counts, 0) != phnum_counts.end()) {
+                throw pil::Error("Segment counts must be at least 1");
+            }
+            bool own_dir = matrix.dir.empty();
+            if (own_dir) {
+                matrix.dir = fs::temp_directory_path() / std::format("pil-bench-{}", ::getpid());
+            }
+            fs::create_directories(matrix.dir);
+            int result = pil::phnum_stress(matrix, phnum_counts, args.size() == 2 ? args[1] : "");
+            if (own_dir) {
+                fs::remove_all(matrix.dir);
+            }
+            return result;
+        } else if (command == "micro" && args.size() <= 2) {
+            return pil::micro(phdr_count, repeat, args.size() == 2 ? args[1] : "");
+        } else if (command == "compare" && args.size() == 3) {
+            return pil::compare(args[1], args[2], threshold);
+        }
+
+        auto name = fs::path(argv[0]).filename().string();
+        std::cerr << std::format("Usage: {} run [--sizes 1M,16M] [--segments 4,32] [--threads 1,4]\n"
+                                 "       {:{}}     [--backends stream,sparse,archive] [--ops squash,split]\n"
+                                 "       {:{}}     [--iterations N] [--seed N] [--dir <work dir>] [--perf]\n"
+                                 "       {:{}}     <results.json>\n"
+                                 "       {} scale [--shapes huge,small,mixed] [--threads 1,2,4] [--sizes 16M]\n"
+                                 "       {:{}}       [--backends stream] [--ops squash,split] [--iterations N]\n"
+                                 "       {:{}}       [--seed N] [--dir <work dir>] [--perf] <results.json>\n"
+                                 "       {} phnum [--counts 16,256,4096,65536] [--iterations N] [--seed N]\n"
+                                 "       {:{}}       [--dir <work dir>] [<results.json>]\n"
+                                 "       {} micro [--phdrs N] [--repeat N] [<results.json>]\n"
+                                 "       {} compare [--threshold <percent>] <baseline.json> <results.json>\n",
+                                 name, "", name.size(), "", name.size(), "", name.size(),
+                                 name, "", name.size(), "", name.size(),
+                                 name, "", name.size(), name, name);
+        return 1;
+
+    } catch (const std::ios_base::failure& e) {
+        auto ec = errno ? std::error_code(errno, std::system_category())
+                        : std::make_error_code(std::errc::io_error);
+        std::cerr << std::format("I/O Error: {}\n", ec.message());
+        return 1;
+    } catch (const std::system_error& e) {
+        std::cerr << std::format("Error: {} ({})\n", e.what(), e.code().message());
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << std::format("Error: {}\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#include "pil_bundle.hpp"
+#include "pil_split.hpp"
+#include "pil_metrics.hpp"
+
+#include <iostream>
+#include <filesystem>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <optional>
+
+namespace fs = std::filesystem;
+namespace pil {
+
+void create(const fs::path& bundle_path, std::span<const std::string_view> mbn_paths) {
+    BundleWriter writer(bundle_path);
+    for (auto mbn_path : mbn_paths) {
+        writer.add_image(fs::path(mbn_path).filename().string(), mbn_path);
+    }
+    writer.finish();
+
+    std::cout << std::format("{} images, {} distinct blobs, {} bytes deduplicated\n",
+                             mbn_paths.size(), writer.blob_count(), writer.deduplicated_bytes());
+}
+
+void list(const fs::path& bundle_path) {
+    Bundle bundle(bundle_path);
+    for (const auto& image : bundle.images()) {
+        std::cout << std::format("{} {} bytes, {} pieces\n",
+                                 image.name, image.size, image.pieces.size());
+    }
+}
+
+// Splits a member into <output dir>/<member stem>.mdt + bXX through the
+// regular split path, reading it straight out of the mapped bundle
+void extract_image(const Bundle& bundle, const Bundle::Image& image, const fs::path& output_dir) {
+    CountedImage counted;
+    BundleImageBuf buf(bundle, image);
+    std::istream mbn(&buf);
+    mbn.exceptions(std::ios::failbit | std::ios::badbit);
+
+    auto mdt_path = output_dir / fs::path(image.name).filename();
+    mdt_path.replace_extension(".mdt");
+
+    SplitOptions options;
+    FileSetWriter writer(mdt_path, options);
+    split_with(mbn, UniqueFd(), writer);
+}
+
+// Members are independent, so workers just pull the next one off a counter
+void extract(const fs::path& bundle_path, const fs::path& output_dir,
+             std::span<const std::string_view> names, unsigned jobs)
+{
+    Bundle bundle(bundle_path);
+
+    std::vector<const Bundle::Image*> selected;
+    if (names.empty()) {
+        for (const auto& image : bundle.images()) {
+            selected.push_back(&image);
+        }
+    }
+    for (auto name : names) {
+        auto image = bundle.find(name);
+        if (!image) {
+            throw Error(std::format("{} not found in {}", name, bundle_path.string()));
+        }
+        selected.push_back(image);
+    }
+
+    fs::create_directories(output_dir);
+
+    std::atomic<size_t> next = 0;
+    std::vector<std::exception_ptr> errors(selected.size());
+    auto worker = [&] {
+        for (size_t i = next++; i < selected.size(); i = next++) {
+            try {
+                TraceSpan span("job", selected[i]->size);
+                extract_image(bundle, *selected[i], output_dir);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < std::min<size_t>(jobs, selected.size()); ++t) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+} // namespace pil
+
+int main(int argc, char* argv[]) {
+    try {
+        unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+        fs::path trace_path;
+        fs::path metrics_path;
+        std::vector<std::string_view> args;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (arg == "-j" && i + 1 < argc) {
+                jobs = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--trace" && i + 1 < argc) {
+                trace_path = argv[++i];
+            } else if (arg == "--metrics" && i + 1 < argc) {
+                metrics_path = argv[++i];
+            } else {
+                args.push_back(arg);
+            }
+        }
+
+        auto command = args.empty() ? std::string_view{} : args[0];
+        auto rest = std::span{args}.subspan(std::min<size_t>(args.size(), 1));
+
+        if (command == "create" && rest.size() >= 2) {
+            pil::create(rest[0], rest.subspan(1));
+        } else if (command == "list" && rest.size() == 1) {
+            pil::list(rest[0]);
+        } else if (command == "extract" && rest.size() >= 2) {
+            if (!trace_path.empty()) {
+                pil::tracer().enable();
+            }
+            std::optional<pil::MetricsFile> metrics;
+            if (!metrics_path.empty()) {
+                metrics.emplace(metrics_path);
+            }
+            pil::extract(rest[0], rest[1], rest.subspan(2), jobs);
+            if (!trace_path.empty()) {
+                pil::tracer().write(trace_path);
+            }
+            if (metrics) {
+                metrics->close();
+            }
+        } else {
+            auto name = fs::path(argv[0]).filename().string();
+            std::cerr << std::format("Usage: {} create <bundle> <mbn>...\n"
+                                     "       {} list <bundle>\n"
+                                     "       {} extract [-j N] [--trace <file>] [--metrics <file>] <bundle> <output dir> [member...]\n",
+                                     name, name, name);
+            return 1;
+        }
+        return 0;
+
+    } catch (const std::ios_base::failure& e) {
+        auto ec = errno ? std::error_code(errno, std::system_category())
+                        : std::make_error_code(std::errc::io_error);
+        std::cerr << std::format("I/O Error: {}\n", ec.message());
+        return 1;
+    } catch (const std::system_error& e) {
+        std::cerr << std::format("Error: {} ({})\n", e.what(), e.code().message());
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << std::format("Error: {}\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,398 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#include "pil_squash.hpp"
+#include "pil_split.hpp"
+#include "pil_socket.hpp"
+#include "pil_metrics.hpp"
+
+#include <iostream>
+#include <filesystem>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+namespace fs = std::filesystem;
+namespace pil {
+
+// Protocol: one job per line, fields separated by tabs.
+//
+//   squash <mdt input> <mbn output>     reply: ok <microseconds>
+//   split <mbn input> <mdt output>             error <message>
+//   shutdown
+//
+// An mbn field of "fd" means the client passed that file as a descriptor with
+// the request, so the daemon needs no access to its path: the output of a
+// squash, the input of a split. The mdt side is always a path, since the bXX
+// files are found next to it.
+
+auto split_fields(std::string_view line) -> std::vector<std::string_view> {
+    std::vector<std::string_view> fields;
+    while (true) {
+        auto tab = line.find('\t');
+        fields.push_back(line.substr(0, tab));
+        if (tab == std::string_view::npos) break;
+        line.remove_prefix(tab + 1);
+    }
+    return fields;
+}
+
+// The path of an mbn field, reopening the passed descriptor for "fd"
+auto mbn_field_path(std::string_view field, const std::vector<UniqueFd>& fds) -> fs::path {
+    if (field != "fd") {
+        return field;
+    }
+    if (fds.empty()) {
+        throw Error("No mbn descriptor passed");
+    }
+    return fd_path(fds.front().get());
+}
+
+auto run_job(const std::vector<std::string_view>& fields, const std::vector<UniqueFd>& fds)
+    -> std::string
+{
+    auto start = std::chrono::steady_clock::now();
+    TraceSpan span("job");
+
+    try {
+        if (fields.size() == 3 && fields[0] == "squash") {
+            squash(fields[1], mbn_field_path(fields[2], fds));
+        } else if (fields.size() == 3 && fields[0] == "split") {
+            split(mbn_field_path(fields[1], fds), fields[2]);
+        } else {
+            throw Error("Malformed request");
+        }
+    } catch (const std::system_error& e) {
+        return std::format("error {} ({})\n", e.what(), e.code().message());
+    } catch (const std::exception& e) {
+        return std::format("error {}\n", e.what());
+    }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::format("ok {}\n",
+                       std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+struct Connection {
+    explicit Connection(int fd) : fd(fd), reader(fd) {}
+
+    UniqueFd fd;
+    MessageReader reader;
+};
+
+struct Job {
+    std::unique_ptr<Connection> conn;
+    std::string line;
+    std::vector<UniqueFd> fds;
+};
+
+// serve() polls the listener and every idle connection. Each complete request
+// is queued as a job for a fixed set of worker threads, which stay alive (and
+// warm) for the life of the daemon; the connection goes back to the poll loop
+// once its reply is sent. Workers only ever run jobs, so clients that connect
+// and stay quiet cannot hold one up, and shutdown does not wait for them.
+class Daemon {
+public:
+    Daemon(const fs::path& socket_path, unsigned workers)
+        : socket_path_(socket_path), listener_(listen_unix(socket_path)),
+          wake_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    {
+        if (!wake_) {
+            throw_system_error("Failed to create eventfd");
+        }
+        // Poll can report a connection that is gone by the time it is accepted
+        ::fcntl(listener_.get(), F_SETFL, ::fcntl(listener_.get(), F_GETFL) | O_NONBLOCK);
+
+        for (unsigned i = 0; i < workers; ++i) {
+            workers_.emplace_back([this] { work(); });
+        }
+    }
+
+    // Jobs already queued still run and get their replies
+    ~Daemon() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+
+        std::error_code ec;
+        fs::remove(socket_path_, ec);
+    }
+
+    // Returns after a shutdown request; idle connections are closed then
+    void serve() {
+        std::vector<std::unique_ptr<Connection>> idle;
+        std::vector<pollfd> pollfds;
+
+        while (true) {
+            {
+                std::lock_guard lock(mutex_);
+                for (auto& conn : returned_) {
+                    idle.push_back(std::move(conn));
+                }
+                returned_.clear();
+            }
+
+            // A returned connection may already hold its next request
+            for (size_t i = 0; i < idle.size();) {
+                if (dispatch(idle[i])) {
+                    idle.erase(idle.begin() + i);
+                } else {
+                    ++i;
+                }
+            }
+            if (stopping()) return;
+
+            pollfds.assign({{listener_.get(), POLLIN, 0}, {wake_.get(), POLLIN, 0}});
+            for (const auto& conn : idle) {
+                pollfds.push_back({conn->fd.get(), POLLIN, 0});
+            }
+            if (::poll(pollfds.data(), pollfds.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                throw_system_error("Failed to poll");
+            }
+
+            if (pollfds[1].revents) {
+                uint64_t count;
+                [[maybe_unused]] auto n = ::read(wake_.get(), &count, sizeof(count));
+            }
+
+            // Back to front, so erasing keeps the remaining indices valid
+            for (size_t i = idle.size(); i-- > 0;) {
+                if (!pollfds[i + 2].revents) continue;
+                try {
+                    if (idle[i]->reader.fill(MSG_DONTWAIT)) continue;
+                } catch (const std::exception& e) {
+                    std::cerr << std::format("Connection error: {}\n", e.what());
+                }
+                idle.erase(idle.begin() + i);
+            }
+
+            if (pollfds[0].revents) {
+                accept_all(idle);
+            }
+        }
+    }
+
+private:
+    bool stopping() {
+        std::lock_guard lock(mutex_);
+        return stopping_;
+    }
+
+    void accept_all(std::vector<std::unique_ptr<Connection>>& idle) {
+        while (true) {
+            int fd = ::accept4(listener_.get(), nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                idle.push_back(std::make_unique<Connection>(fd));
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            throw_system_error("Failed to accept connection");
+        }
+    }
+
+    // Queues the connection's next complete request, if it has one. Shutdown
+    // is answered right here, so it works however busy the workers are.
+    bool dispatch(std::unique_ptr<Connection>& conn) {
+        Job job;
+        if (!conn->reader.next_line(job.line, job.fds)) {
+            return false;
+        }
+
+        if (job.line == "shutdown") {
+            {
+                std::lock_guard lock(mutex_);
+                stopping_ = true;
+            }
+            try {
+                send_message(conn->fd.get(), "ok 0\n");
+            } catch (const std::exception& e) {
+                std::cerr << std::format("Connection error: {}\n", e.what());
+            }
+            return true;
+        }
+
+        job.conn = std::move(conn);
+        std::lock_guard lock(mutex_);
+        queue_.push_back(std::move(job));
+        ready_.notify_one();
+        return true;
+    }
+
+    void work() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock lock(mutex_);
+                ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                job = std::move(queue_.front());
+                queue_.pop_front();
+            }
+
+            try {
+                send_message(job.conn->fd.get(), run_job(split_fields(job.line), job.fds));
+            } catch (const std::exception& e) {
+                std::cerr << std::format("Connection error: {}\n", e.what());
+                continue;
+            }
+
+            {
+                std::lock_guard lock(mutex_);
+                returned_.push_back(std::move(job.conn));
+            }
+            uint64_t one = 1;
+            [[maybe_unused]] auto n = ::write(wake_.get(), &one, sizeof(one));
+        }
+    }
+
+    fs::path socket_path_;
+    UniqueFd listener_;
+    UniqueFd wake_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Job> queue_;
+    std::vector<std::unique_ptr<Connection>> returned_;
+    bool stopping_ = false;
+};
+
+// Client side: sends one job and prints the reply. Relative paths are made
+// absolute first, since the daemon does not share our working directory. With
+// pass_fd the mbn (a squash's output, a split's input) is opened here and
+// passed as a descriptor instead.
+int request(const fs::path& socket_path, std::string_view command,
+            const fs::path& input, const fs::path& output, bool pass_fd)
+{
+    auto sock = connect_unix(socket_path);
+
+    bool squash = command == "squash";
+    std::string input_field = fs::absolute(input).string();
+    std::string output_field = fs::absolute(output).string();
+    UniqueFd mbn_fd;
+    if (pass_fd && squash) {
+        mbn_fd = UniqueFd(::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (!mbn_fd) {
+            throw_system_error(std::format("Failed to create {}", output.string()));
+        }
+        output_field = "fd";
+    } else if (pass_fd) {
+        mbn_fd = UniqueFd(::open(input.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!mbn_fd) {
+            throw_system_error(std::format("Failed to open {}", input.string()));
+        }
+        input_field = "fd";
+    }
+
+    auto message = std::format("{}\t{}\t{}\n", command, input_field, output_field);
+    int fds[] = {mbn_fd.get()};
+    send_message(sock.get(), message, pass_fd ? std::span<const int>(fds) : std::span<const int>());
+
+    MessageReader reader(sock.get());
+    std::string reply;
+    std::vector<UniqueFd> unused;
+    if (!reader.read_line(reply, unused)) {
+        throw Error("Daemon closed the connection");
+    }
+
+    std::cout << reply << '\n';
+    return reply.starts_with("ok ") ? 0 : 1;
+}
+
+int request_shutdown(const fs::path& socket_path) {
+    auto sock = connect_unix(socket_path);
+    send_message(sock.get(), "shutdown\n");
+
+    MessageReader reader(sock.get());
+    std::string reply;
+    std::vector<UniqueFd> unused;
+    return reader.read_line(reply, unused) && reply.starts_with("ok") ? 0 : 1;
+}
+
+} // namespace pil
+
+int main(int argc, char* argv[]) {
+    try {
+        unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+        bool pass_fd = false;
+        fs::path trace_path;
+        fs::path metrics_path;
+        std::vector<std::string_view> args;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (arg == "-j" && i + 1 < argc) {
+                jobs = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--pass-fd") {
+                pass_fd = true;
+            } else if (arg == "--trace" && i + 1 < argc) {
+                trace_path = argv[++i];
+            } else if (arg == "--metrics" && i + 1 < argc) {
+                metrics_path = argv[++i];
+            } else {
+                args.push_back(arg);
+            }
+        }
+
+        auto command = args.empty() ? std::string_view{} : args[0];
+
+        if (command == "serve" && args.size() == 2) {
+            if (!trace_path.empty()) {
+                pil::tracer().enable();
+            }
+            std::optional<pil::MetricsFile> metrics;
+            if (!metrics_path.empty()) {
+                metrics.emplace(metrics_path, std::chrono::seconds(10));
+            }
+            {
+                pil::Daemon daemon(args[1], jobs);
+                daemon.serve();
+            }
+            if (metrics) {
+                metrics->close();
+            }
+            // The workers are joined, so their trace buffers are complete
+            if (!trace_path.empty()) {
+                pil::tracer().write(trace_path);
+            }
+            return 0;
+        } else if (command == "squash" && args.size() == 4) {
+            return pil::request(args[1], "squash", args[3], args[2], pass_fd);
+        } else if (command == "split" && args.size() == 4) {
+            return pil::request(args[1], "split", args[2], args[3], pass_fd);
+        } else if (command == "shutdown" && args.size() == 2) {
+            return pil::request_shutdown(args[1]);
+        }
+
+        auto name = fs::path(argv[0]).filename().string();
+        std::cerr << std::format("Usage: {} serve [-j N] [--trace <file>] [--metrics <file>] <socket>\n"
+                                 "       {} squash [--pass-fd] <socket> <mbn output> <mdt input>\n"
+                                 "       {} split [--pass-fd] <socket> <mbn input> <mdt output>\n"
+                                 "       {} shutdown <socket>\n",
+                                 name, name, name, name);
+        return 1;
+
+    } catch (const std::system_error& e) {
+        std::cerr << std::format("Error: {} ({})\n", e.what(), e.code().message());
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << std::format("Error: {}\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#define FUSE_USE_VERSION 31
+
+#include "pil_virtual.hpp"
+
+#include <fuse.h>
+
+#include <iostream>
+#include <filesystem>
+#include <optional>
+
+namespace fs = std::filesystem;
+namespace pil {
+
+// Read-only FUSE view of a flat firmware directory. By default every
+// <name>.mdt there appears as a virtual <name>.mbn; with --reverse every
+// <name>.mbn appears as <name>.mdt plus its <name>.bXX files. Layouts are
+// derived from the headers on each lookup, so the view follows changes to
+// the source directory.
+
+struct MountState {
+    fs::path source_dir;
+    bool reverse = false;
+};
+
+MountState& mount_state() {
+    return *static_cast<MountState*>(fuse_get_context()->private_data);
+}
+
+// Source file a virtual name is derived from
+auto source_of(const MountState& state, std::string_view name) -> std::optional<fs::path> {
+    fs::path path(name);
+    auto ext = path.extension().string();
+
+    if (!state.reverse) {
+        if (ext != ".mbn") return std::nullopt;
+        return state.source_dir / path.replace_extension(".mdt");
+    }
+    if (ext != ".mdt" && !ext.starts_with(".b")) return std::nullopt;
+    return state.source_dir / path.replace_extension(".mbn");
+}
+
+auto find_file(const MountState& state, std::string_view name) -> std::optional<VirtualFile> {
+    auto source = source_of(state, name);
+    std::error_code ec;
+    if (!source || !fs::is_regular_file(*source, ec)) {
+        return std::nullopt;
+    }
+
+    if (!state.reverse) {
+        return virtual_mbn(*source);
+    }
+
+    auto mdt_name = fs::path(name).replace_extension(".mdt");
+    for (auto& file : virtual_split(*source, mdt_name)) {
+        if (file.name == name) {
+            return std::move(file.file);
+        }
+    }
+    return std::nullopt;
+}
+
+// Runs a callback body, turning exceptions into negative errno values since
+// they must not unwind through libfuse
+template<typename Body>
+int guarded(Body&& body) {
+    try {
+        return body();
+    } catch (const std::system_error& e) {
+        // Only these categories hold errno values; ios_base::failure, for
+        // one, carries iostream_category codes
+        auto& category = e.code().category();
+        if ((category == std::system_category() || category == std::generic_category()) &&
+            e.code().value() > 0) {
+            return -e.code().value();
+        }
+        std::cerr << std::format("Error: {}\n", e.what());
+        return -EIO;
+    } catch (const std::exception& e) {
+        std::cerr << std::format("Error: {}\n", e.what());
+        return -EIO;
+    }
+}
+
+int fs_getattr(const char* path, struct stat* st, fuse_file_info*) {
+    return guarded([&] {
+        std::memset(st, 0, sizeof(*st));
+        std::string_view name(path);
+
+        if (name == "/") {
+            st->st_mode = S_IFDIR | 0555;
+            st->st_nlink = 2;
+            return 0;
+        }
+
+        auto& state = mount_state();
+        auto file = find_file(state, name.substr(1));
+        if (!file) {
+            return -ENOENT;
+        }
+
+        struct stat source_st;
+        if (::stat(source_of(state, name.substr(1))->c_str(), &source_st) == 0) {
+            st->st_mtim = source_st.st_mtim;
+            st->st_ctim = source_st.st_ctim;
+            st->st_atim = source_st.st_atim;
+        }
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = static_cast<off_t>(file->size());
+        return 0;
+    });
+}
+
+int fs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t, fuse_file_info*,
+               fuse_readdir_flags)
+{
+    return guarded([&] {
+        if (std::string_view(path) != "/") {
+            return -ENOENT;
+        }
+
+        filler(buf, ".", nullptr, 0, fuse_fill_dir_flags{});
+        filler(buf, "..", nullptr, 0, fuse_fill_dir_flags{});
+
+        auto& state = mount_state();
+        for (const auto& entry : fs::directory_iterator(state.source_dir)) {
+            std::error_code ec;
+            if (!entry.is_regular_file(ec)) continue;
+
+            auto source = entry.path();
+            if (!state.reverse && source.extension() == ".mdt") {
+                auto name = source.filename().replace_extension(".mbn").string();
+                filler(buf, name.c_str(), nullptr, 0, fuse_fill_dir_flags{});
+            } else if (state.reverse && source.extension() == ".mbn") {
+                // Unreadable images are left out rather than failing the listing
+                try {
+                    auto mdt_name = source.filename().replace_extension(".mdt");
+                    for (const auto& file : virtual_split(source, mdt_name)) {
+                        filler(buf, file.name.c_str(), nullptr, 0, fuse_fill_dir_flags{});
+                    }
+                } catch (const std::exception&) {
+                }
+            }
+        }
+        return 0;
+    });
+}
+
+int fs_open(const char* path, fuse_file_info* fi) {
+    return guarded([&] {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EROFS;
+        }
+
+        auto file = find_file(mount_state(), std::string_view(path).substr(1));
+        if (!file) {
+            return -ENOENT;
+        }
+
+        file->open();
+        fi->fh = reinterpret_cast<uint64_t>(new VirtualFile(std::move(*file)));
+        fi->keep_cache = 1;
+        return 0;
+    });
+}
+
+int fs_read(const char*, char* buf, size_t size, off_t offset, fuse_file_info* fi) {
+    return guarded([&] {
+        auto file = reinterpret_cast<const VirtualFile*>(fi->fh);
+        return static_cast<int>(file->read(static_cast<uint64_t>(offset),
+                                           std::span{reinterpret_cast<uint8_t*>(buf), size}));
+    });
+}
+
+int fs_release(const char*, fuse_file_info* fi) {
+    delete reinterpret_cast<VirtualFile*>(fi->fh);
+    return 0;
+}
+
+} // namespace pil
+
+int main(int argc, char* argv[]) {
+    pil::MountState state;
+    std::vector<char*> fuse_args{argv[0]};
+    std::vector<std::string_view> args;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--reverse") {
+            state.reverse = true;
+        } else if (arg.starts_with("-")) {
+            // Everything else with a dash is a FUSE option, e.g. -f or -o allow_other
+            fuse_args.push_back(argv[i]);
+            if ((arg == "-o") && i + 1 < argc) {
+                fuse_args.push_back(argv[++i]);
+            }
+        } else {
+            args.push_back(arg);
+            if (args.size() == 2) {
+                fuse_args.push_back(argv[i]);
+            }
+        }
+    }
+
+    if (args.size() != 2) {
+        auto name = fs::path(argv[0]).filename().string();
+        std::cerr << std::format("Usage: {} [--reverse] [FUSE options] <source dir> <mountpoint>\n",
+                                 name);
+        return 1;
+    }
+
+    std::error_code ec;
+    state.source_dir = fs::absolute(args[0], ec);
+    if (ec || !fs::is_directory(state.source_dir, ec)) {
+        std::cerr << std::format("Error: {} is not a directory\n", args[0]);
+        return 1;
+    }
+
+    static char read_only[] = "-oro";
+    fuse_args.push_back(read_only);
+
+    fuse_operations ops{};
+    ops.getattr = pil::fs_getattr;
+    ops.readdir = pil::fs_readdir;
+    ops.open = pil::fs_open;
+    ops.read = pil::fs_read;
+    ops.release = pil::fs_release;
+
+    return fuse_main(static_cast<int>(fuse_args.size()), fuse_args.data(), &ops, &state);
+}
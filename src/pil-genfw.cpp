@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#include "pil_genfw.hpp"
+#include "pil_split.hpp"
+#include "pil_cache.hpp"
+
+#include <iostream>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+int main(int argc, char* argv[]) {
+    try {
+        pil::GenOptions options;
+        std::vector<std::string_view> args;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            std::string_view value = i + 1 < argc ? argv[i + 1] : "";
+
+            if (arg == "--elf64") {
+                options.elf_class = ELFCLASS64;
+            } else if (arg == "--big-endian") {
+                options.little_endian = false;
+            } else if (arg == "--segments" && i + 1 < argc) {
+                options.segments = std::stoul(argv[++i]);
+            } else if (arg == "--empty-segments" && i + 1 < argc) {
+                options.empty_segments = std::stoul(argv[++i]);
+            } else if (arg == "--size" && i + 1 < argc) {
+                // <size> or <min>:<max>
+                auto colon = value.find(':');
+                options.min_segment_size = pil::parse_size(value.substr(0, colon));
+                options.max_segment_size = colon == std::string_view::npos
+                    ? options.min_segment_size
+                    : pil::parse_size(value.substr(colon + 1));
+                ++i;
+            } else if (arg == "--hash-index" && i + 1 < argc) {
+                options.hash_index = std::stoul(argv[++i]);
+            } else if (arg == "--xnum") {
+                options.xnum = true;
+            } else if (arg == "--no-hash") {
+                options.hash_index.reset();
+            } else if (arg == "--gap" && i + 1 < argc) {
+                options.gap = pil::parse_size(argv[++i]);
+            } else if (arg == "--zero-fraction" && i + 1 < argc) {
+                options.zero_fraction = std::stod(argv[++i]);
+            } else if (arg == "--seed" && i + 1 < argc) {
+                options.seed = std::stoull(argv[++i]);
+            } else {
+                args.push_back(arg);
+            }
+        }
+
+        if (args.empty() || args.size() > 2) {
+            auto name = fs::path(argv[0]).filename().string();
+            std::cerr << std::format("Usage: {} [--elf64] [--big-endian] [--segments N] [--empty-segments N]\n"
+                                     "       {:{}} [--size <size>|<min>:<max>] [--hash-index N | --no-hash]\n"
+                                     "       {:{}} [--gap <size>] [--zero-fraction F] [--seed N] [--xnum]\n"
+                                     "       {:{}} <mbn output> [<mdt output>]\n",
+                                     name, "", name.size(), "", name.size(), "", name.size());
+            return 1;
+        }
+
+        pil::generate(args[0], options);
+        if (args.size() == 2) {
+            pil::split(args[0], args[1]);
+        }
+        return 0;
+
+    } catch (const std::ios_base::failure& e) {
+        auto ec = errno ? std::error_code(errno, std::system_category())
+                        : std::make_error_code(std::errc::io_error);
+        std::cerr << std::format("I/O Error: {}\n", ec.message());
+        return 1;
+    } catch (const std::system_error& e) {
+        std::cerr << std::format("Error: {} ({})\n", e.what(), e.code().message());
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << std::format("Error: {}\n", e.what());
+        return 1;
+    }
+}
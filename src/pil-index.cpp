@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#include "pil_index.hpp"
+
+#include <iostream>
+#include <filesystem>
+#include <map>
+#include <cctype>
+
+namespace fs = std::filesystem;
+namespace pil {
+
+// Collects every sidecar under root into one index. Image names become paths
+// relative to root so matches can be traced back to their files.
+void merge(const fs::path& output, const fs::path& root) {
+    std::vector<fs::path> sidecars;
+    std::error_code ec;
+    for (const auto& entry : fs::recursive_directory_iterator(root)) {
+        if (entry.is_regular_file() && entry.path().extension() == PIL_INDEX_EXTENSION &&
+            !fs::equivalent(entry.path(), output, ec)) {
+            sidecars.push_back(entry.path());
+        }
+    }
+    std::ranges::sort(sidecars);
+
+    LayoutIndex merged;
+    for (const auto& path : sidecars) {
+        auto dir = fs::relative(path, root).parent_path();
+        auto index = MappedIndex(path).load();
+        for (auto& image : index.images) {
+            image.name = (dir / image.name).generic_string();
+            merged.images.push_back(std::move(image));
+        }
+    }
+
+    write_index_file(output, merged);
+    std::cout << std::format("{} images from {} sidecars\n", merged.images.size(), sidecars.size());
+}
+
+void dump(const MappedIndex& index) {
+    for (uint32_t i = 0; i < index.image_count(); ++i) {
+        auto image = index.image(i);
+        std::cout << std::format("{}: ELF{} {}, {} bytes, {} segments\n", image.name,
+                                 image.elf_class == ELFCLASS64 ? 64 : 32,
+                                 image.is_little_endian ? "LE" : "BE",
+                                 image.image_size, image.segment_count);
+
+        for (uint32_t s = 0; s < image.segment_count; ++s) {
+            auto seg = index.segment(image.first_segment + s);
+            std::cout << std::format("  [{:2}] offset {:#010x} filesz {:#010x} memsz {:#010x} "
+                                     "flags {:#010x}{} {}\n",
+                                     s, seg.offset, seg.filesz, seg.memsz, seg.flags,
+                                     s == image.hash_segment ? " hash" : "",
+                                     to_hex(seg.digest));
+        }
+    }
+}
+
+void find_digest(const MappedIndex& index, std::string_view hex) {
+    Sha256::Digest digest;
+    if (hex.size() != digest.size() * 2) {
+        throw Error(std::format("{} is not a SHA-256 digest", hex));
+    }
+    for (size_t i = 0; i < digest.size(); ++i) {
+        auto byte = std::string(hex.substr(i * 2, 2));
+        if (!std::isxdigit(static_cast<unsigned char>(byte[0])) ||
+            !std::isxdigit(static_cast<unsigned char>(byte[1]))) {
+            throw Error(std::format("{} is not a SHA-256 digest", hex));
+        }
+        digest[i] = static_cast<uint8_t>(std::stoul(byte, nullptr, 16));
+    }
+
+    for (auto n : index.find_digest(digest)) {
+        auto seg = index.segment(n);
+        auto image = index.image(seg.image);
+        std::cout << std::format("{} segment {}\n", image.name, n - image.first_segment);
+    }
+}
+
+void bytes_by_type(const MappedIndex& index) {
+    std::map<uint32_t, std::pair<uint64_t, uint64_t>> totals;
+    for (uint32_t i = 0; i < index.segment_count(); ++i) {
+        auto seg = index.segment(i);
+        auto& [count, bytes] = totals[pil_segment_type(seg.flags)];
+        ++count;
+        bytes += seg.filesz;
+    }
+
+    for (auto [type, total] : totals) {
+        std::cout << std::format("type {}: {} segments, {} bytes\n", type, total.first, total.second);
+    }
+}
+
+} // namespace pil
+
+int main(int argc, char* argv[]) {
+    try {
+        std::string_view command = argc > 1 ? argv[1] : "";
+
+        if (command == "merge" && argc == 4) {
+            pil::merge(argv[2], argv[3]);
+        } else if (command == "dump" && argc == 3) {
+            pil::dump(pil::MappedIndex(argv[2]));
+        } else if (command == "find-digest" && argc == 4) {
+            pil::find_digest(pil::MappedIndex(argv[2]), argv[3]);
+        } else if (command == "bytes-by-type" && argc == 3) {
+            pil::bytes_by_type(pil::MappedIndex(argv[2]));
+        } else {
+            auto name = fs::path(argv[0]).filename().string();
+            std::cerr << std::format("Usage: {} merge <index output> <directory>\n"
+                                     "       {} dump <index>\n"
+                                     "       {} find-digest <index> <sha256>\n"
+                                     "       {} bytes-by-type <index>\n",
+                                     name, name, name, name);
+            return 1;
+        }
+        return 0;
+
+    } catch (const std::system_error& e) {
+        std::cerr << std::format("Error: {} ({})\n", e.what(), e.code().message());
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << std::format("Error: {}\n", e.what());
+        return 1;
+    }
+}
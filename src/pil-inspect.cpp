@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#include "pil_inspect.hpp"
+
+#include <iostream>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+namespace pil {
+
+auto open_image(const fs::path& path) -> std::ifstream {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw_system_error(std::format("Failed to open {}", path.string()));
+    }
+    file.exceptions(std::ios::failbit | std::ios::badbit);
+    return file;
+}
+
+std::string json_string(std::string_view s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out += std::format("\\u{:04x}", c);
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+std::string_view type_name(uint32_t p_type) {
+    switch (p_type) {
+    case PT_NULL: return "NULL";
+    case PT_LOAD: return "LOAD";
+    case PT_DYNAMIC: return "DYNAMIC";
+    case PT_INTERP: return "INTERP";
+    case PT_NOTE: return "NOTE";
+    case PT_PHDR: return "PHDR";
+    default: return "";
+    }
+}
+
+std::string pil_type_name(uint32_t p_flags) {
+    switch (auto type = pil_segment_type(p_flags)) {
+    case 0: return "-";
+    case PIL_SEGMENT_TYPE_HASH: return "hash";
+    case PIL_SEGMENT_TYPE_PHDR: return "phdr";
+    default: return std::format("{}", type);
+    }
+}
+
+std::string rwx(uint32_t p_flags) {
+    return {p_flags & PF_R ? 'R' : '-', p_flags & PF_W ? 'W' : '-', p_flags & PF_X ? 'X' : '-'};
+}
+
+void dump(const fs::path& path, bool json) {
+    auto file = open_image(path);
+    auto image = inspect_image(file);
+    auto hashes = mdt_hash_offsets(image);
+    auto mdt_offset = [&](size_t i) -> std::optional<uint64_t> {
+        auto it = std::ranges::find(hashes, i, &std::pair<size_t, uint64_t>::first);
+        return it == hashes.end() ? std::nullopt : std::optional(it->second);
+    };
+
+    if (json) {
+        std::cout << std::format("{{\"file\": {}, \"class\": {}, \"endian\": \"{}\", \"xnum\": {}, "
+                                 "\"file_size\": {}, \"header_size\": {}, \"segments\": [",
+                                 json_string(path.string()),
+                                 image.elf_class == ELFCLASS64 ? 64 : 32,
+                                 image.is_little_endian ? "LE" : "BE", image.xnum,
+                                 image.file_size, image.header_size);
+        for (size_t i = 0; i < image.segments.size(); ++i) {
+            const auto& s = image.segments[i];
+            std::cout << std::format("{}{{\"index\": {}, \"type\": {}, \"flags\": {}, \"pil_type\": {}, "
+                                     "\"offset\": {}, \"filesz\": {}, \"vaddr\": {}, \"paddr\": {}, "
+                                     "\"memsz\": {}, \"align\": {}",
+                                     i ? ", " : "", i, s.type, s.flags, pil_segment_type(s.flags),
+                                     s.offset, s.filesz, s.vaddr, s.paddr, s.memsz, s.align);
+            if (auto offset = mdt_offset(i)) {
+                std::cout << std::format(", \"mdt_offset\": {}", *offset);
+            }
+            std::cout << "}";
+        }
+        std::cout << "]}\n";
+        return;
+    }
+
+    std::cout << std::format("{}: ELF{} {}{}, {} segments, headers {:#x} bytes, file {:#x} bytes\n",
+                             path.string(), image.elf_class == ELFCLASS64 ? 64 : 32,
+                             image.is_little_endian ? "LE" : "BE", image.xnum ? " PN_XNUM" : "",
+                             image.segments.size(), image.header_size, image.file_size);
+    std::cout << std::format("  {:>5} {:<8} {:>10} {:>10} {:>10} {:>10} {:>10} {:>3} {:>10} {:>7}\n",
+                             "index", "type", "offset", "filesz", "vaddr", "paddr", "memsz",
+                             "rwx", "pil", "align");
+    for (size_t i = 0; i < image.segments.size(); ++i) {
+        const auto& s = image.segments[i];
+        auto type = type_name(s.type);
+        std::cout << std::format("  {:>5} {:<8} {:#10x} {:#10x} {:#10x} {:#10x} {:#10x} {} {:>10} {:#7x}\n",
+                                 i, type.empty() ? std::format("{:#x}", s.type) : std::string(type),
+                                 s.offset, s.filesz, s.vaddr, s.paddr, s.memsz, rwx(s.flags),
+                                 pil_type_name(s.flags), s.align);
+    }
+    for (auto [i, offset] : hashes) {
+        std::cout << std::format("  hash segment {}: {:#x} bytes at {:#x}, at {:#x} in the mdt\n",
+                                 i, image.segments[i].filesz, image.segments[i].offset, offset);
+    }
+}
+
+// Checks each image, expanding directories to the mbn and mdt files under
+// them. Returns whether every image passed.
+bool check(std::span<const std::string_view> paths, bool json) {
+    std::vector<fs::path> images;
+    for (auto p : paths) {
+        fs::path path(p);
+        if (!fs::is_directory(path)) {
+            images.push_back(path);
+            continue;
+        }
+        std::vector<fs::path> found;
+        for (const auto& entry : fs::recursive_directory_iterator(
+                 path, fs::directory_options::skip_permission_denied)) {
+            auto ext = entry.path().extension();
+            if (entry.is_regular_file() && (ext == ".mbn" || ext == ".mdt")) {
+                found.push_back(entry.path());
+            }
+        }
+        std::ranges::sort(found);
+        images.insert(images.end(), found.begin(), found.end());
+    }
+
+    size_t failed = 0;
+    for (const auto& path : images) {
+        std::vector<std::string> issues;
+        try {
+            auto file = open_image(path);
+            issues = validate_image(inspect_image(file), path);
+        } catch (const std::ios_base::failure&) {
+            issues.push_back("headers are truncated");
+        } catch (const std::system_error& e) {
+            issues.push_back(std::format("{} ({})", e.what(), e.code().message()));
+        } catch (const std::exception& e) {
+            issues.push_back(e.what());
+        }
+        failed += !issues.empty();
+
+        if (json) {
+            std::cout << std::format("{{\"file\": {}, \"ok\": {}, \"issues\": [",
+                                     json_string(path.string()), issues.empty());
+            for (size_t i = 0; i < issues.size(); ++i) {
+                std::cout << (i ? ", " : "") << json_string(issues[i]);
+            }
+            std::cout << "]}\n";
+        } else {
+            for (const auto& issue : issues) {
+                std::cout << std::format("{}: {}\n", path.string(), issue);
+            }
+        }
+    }
+
+    if (!json) {
+        std::cout << std::format("{} images checked, {} with problems\n", images.size(), failed);
+    }
+    return failed == 0;
+}
+
+} // namespace pil
+
+int main(int argc, char* argv[]) {
+    try {
+        bool json = false;
+        std::vector<std::string_view> args;
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (arg == "--json") {
+                json = true;
+            } else {
+                args.push_back(arg);
+            }
+        }
+
+        auto command = args.empty() ? std::string_view{} : args[0];
+        auto rest = std::span{args}.subspan(std::min<size_t>(args.size(), 1));
+
+        if (command == "dump" && !rest.empty()) {
+            for (auto path : rest) {
+                pil::dump(path, json);
+            }
+            return 0;
+        } else if (command == "check" && !rest.empty()) {
+            return pil::check(rest, json) ? 0 : 1;
+        }
+
+        auto name = fs::path(argv[0]).filename().string();
+        std::cerr << std::format("Usage: {} dump [--json] <image>...\n"
+                                 "       {} check [--json] <image or directory>...\n",
+                                 name, name);
+        return 1;
+
+    } catch (const std::ios_base::failure& e) {
+        auto ec = errno ? std::error_code(errno, std::system_category())
+                        : std::make_error_code(std::errc::io_error);
+        std::cerr << std::format("I/O Error: {}\n", ec.message());
+        return 1;
+    } catch (const std::system_error& e) {
+        std::cerr << std::format("Error: {} ({})\n", e.what(), e.code().message());
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << std::format("Error: {}\n", e.what());
+        return 1;
+    }
+}
@@ -2,105 +2,118 @@
 /*
  * Copyright (c) 2025, Hao Li
  */
-#include "pil_common.hpp"
+#include "pil_split.hpp"
+#include "pil_memfd.hpp"
+#include "pil_metrics.hpp"
 
 #include <iostream>
 #include <filesystem>
+#include <optional>
 
 namespace fs = std::filesystem;
-namespace pil {
 
-void write_segment_file(const fs::path& mdt_path, size_t segment_index,
-                        std::span<const uint8_t> data)
-{
-    auto bxx_path = mdt_path;
-    bxx_path.replace_extension(std::format(".b{:02d}", segment_index));
-
-    std::ofstream bxx(bxx_path, std::ios::binary | std::ios::trunc);
-    if (!bxx) {
-        throw_system_error(std::format("Failed to create {}", bxx_path.string()));
-    }
-    bxx.exceptions(std::ios::failbit | std::ios::badbit);
-    bxx.write(reinterpret_cast<const char*>(data.data()), data.size());
-}
-
-template<typename ElfHeader, typename ElfPhdr>
-void split_impl(std::ifstream& mbn, std::ofstream& mdt, const fs::path& mdt_path,
-                bool is_little_endian)
-{
-    auto ehdr = read_elf_header<ElfHeader>(mbn);
-    auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(mbn, ehdr, is_little_endian);
-
-    // Write ELF header to mdt
-    write_file_at(mdt, 0, std::span{
-        reinterpret_cast<const uint8_t*>(&ehdr),
-        sizeof(ElfHeader)
-    });
-
-    // Write program headers to mdt
-    auto phoff = from_file_endian(ehdr.e_phoff, is_little_endian);
-    for (size_t i = 0; i < phdrs.size(); ++i) {
-        write_file_at(mdt, phoff + i * sizeof(ElfPhdr), std::span{
-            reinterpret_cast<const uint8_t*>(&phdrs[i]),
-            sizeof(ElfPhdr)
-        });
-    }
-
-    // Process each segment
-    for (size_t i = 0; i < phdrs.size(); ++i) {
-        auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
-
-        if (p_filesz == 0) continue;
-
-        auto segment = read_file_at(mbn, p_offset, p_filesz);
-
-        // Write to .bXX file
-        write_segment_file(mdt_path, i, segment);
-
-        // Hash segments (type 2) go into mdt after the program headers
-        if (is_pil_hash_segment(p_flags)) {
-            append_to_file(mdt, segment);
+int main(int argc, char* argv[]) {
+    try {
+        pil::SplitOptions options;
+        std::optional<pil::ArchiveFormat> archive_format;
+        fs::path archive_path;
+        bool stats = false, stats_json = false;
+        bool show_progress = false, progress_json = false;
+        fs::path trace_path;
+        fs::path metrics_path;
+        fs::path memfd_socket;
+        std::string memfd_command;
+        std::vector<std::string_view> args;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if ((arg == "--tar" || arg == "--cpio") && i + 1 < argc) {
+                archive_format = arg == "--tar" ? pil::ArchiveFormat::tar
+                                                : pil::ArchiveFormat::cpio;
+                archive_path = argv[++i];
+            } else if (arg == "--memfd-send" && i + 1 < argc) {
+                memfd_socket = argv[++i];
+            } else if (arg == "--memfd-exec" && i + 1 < argc) {
+                memfd_command = argv[++i];
+            } else if (arg == "--sparse") {
+                options.sparse = true;
+            } else if (arg == "--index") {
+                options.index = true;
+            } else if (arg == "--trace" && i + 1 < argc) {
+                trace_path = argv[++i];
+            } else if (arg == "--metrics" && i + 1 < argc) {
+                metrics_path = argv[++i];
+            } else if (arg == "--progress" || arg == "--progress=json") {
+                show_progress = true;
+                progress_json = arg == "--progress=json";
+            } else if (arg == "--stats" || arg == "--stats=json") {
+                stats = true;
+                stats_json = arg == "--stats=json";
+            } else {
+                args.push_back(arg);
+            }
         }
-    }
-}
-
-void split(const fs::path& mbn_path, const fs::path& mdt_path) {
-    if (mdt_path.extension() != ".mdt") {
-        throw Error(std::format("{} is not a .mdt file", mdt_path.string()));
-    }
 
-    std::ifstream mbn(mbn_path, std::ios::binary);
-    if (!mbn) {
-        throw_system_error(std::format("Failed to open {}", mbn_path.string()));
-    }
-    mbn.exceptions(std::ios::failbit | std::ios::badbit);
-
-    std::ofstream mdt(mdt_path, std::ios::binary | std::ios::trunc);
-    if (!mdt) {
-        throw_system_error(std::format("Failed to create {}", mdt_path.string()));
-    }
-    mdt.exceptions(std::ios::failbit | std::ios::badbit);
-
-    auto format = detect_elf_format(mbn);
+        if (args.size() != 2) {
+            auto name = fs::path(argv[0]).filename().string();
+            std::cerr << std::format("Usage: {} [--sparse] [--index] [--stats[=json]] [--trace <file>] [--progress[=json]]\n"
+                                     "       {:{}} [--metrics <file>] [--tar|--cpio <archive>]\n"
+                                     "       {:{}} [--memfd-send <socket> | --memfd-exec <command>]\n"
+                                     "       {:{}} <mbn input> <mdt output>\n",
+                                     name, "", name.size(), "", name.size(), "", name.size());
+            return 1;
+        }
 
-    if (format.elf_class == ELFCLASS32) {
-        split_impl<Elf32_Ehdr, Elf32_Phdr>(mbn, mdt, mdt_path, format.is_little_endian);
-    } else if (format.elf_class == ELFCLASS64) {
-        split_impl<Elf64_Ehdr, Elf64_Phdr>(mbn, mdt, mdt_path, format.is_little_endian);
-    }
-}
+        bool memfd = !memfd_socket.empty() || !memfd_command.empty();
+        if (memfd && archive_format) {
+            throw pil::Error("memfd output cannot be combined with --tar or --cpio");
+        }
 
-} // namespace pil
+        if (stats) {
+            pil::stats().enable();
+        }
+        if (!trace_path.empty()) {
+            pil::tracer().enable();
+        }
+        std::optional<pil::MetricsFile> metrics;
+        if (!metrics_path.empty()) {
+            metrics.emplace(metrics_path);
+        }
+        std::optional<pil::ProgressTicker> ticker;
+        if (show_progress) {
+            ticker.emplace(std::cerr, progress_json);
+        }
 
-int main(int argc, char* argv[]) {
-    try {
-        if (argc != 3) {
-            std::cerr << std::format("Usage: {} <mbn input> <mdt output>\n",
-                                     fs::path(argv[0]).filename().string());
-            return 1;
+        if (memfd) {
+            // The mdt output names the memfds
+            auto files = pil::split_to_memfds(args[0], args[1], options);
+            ticker.reset();
+            if (stats) {
+                pil::stats().report(std::cerr, stats_json);
+            }
+            if (!trace_path.empty()) {
+                pil::tracer().write(trace_path);
+            }
+            if (metrics) {
+                metrics->close();
+            }
+            return pil::hand_off_memfds(files, memfd_socket, memfd_command);
+        } else if (archive_format) {
+            pil::split_to_archive(args[0], args[1], archive_path, *archive_format, options);
+        } else {
+            pil::split(args[0], args[1], options);
         }
+        ticker.reset();
 
-        pil::split(argv[1], argv[2]);
+        if (stats) {
+            pil::stats().report(std::cerr, stats_json);
+        }
+        if (!trace_path.empty()) {
+            pil::tracer().write(trace_path);
+        }
+        if (metrics) {
+            metrics->close();
+        }
         return 0;
 
     } catch (const std::ios_base::failure& e) {
@@ -3,109 +3,144 @@
  * Copyright (c) 2025, Hao Li
  */
 
-#include "pil_common.hpp"
+#include "pil_squash.hpp"
+#include "pil_watch.hpp"
+#include "pil_memfd.hpp"
+#include "pil_metrics.hpp"
 
 #include <iostream>
 #include <filesystem>
+#include <optional>
 
 namespace fs = std::filesystem;
-namespace pil {
 
-auto read_segment_data(std::ifstream& mdt, const fs::path& mdt_path,
-                       size_t segment_index, size_t filesz,
-                       bool is_hash_segment, size_t& hash_offset)
-    -> std::vector<uint8_t>
-{
-    if (is_hash_segment) {
-        auto segment = read_file_at(mdt, hash_offset, filesz);
-        hash_offset += filesz;
-        return segment;
-    } else {
-        auto bxx_path = mdt_path;
-        bxx_path.replace_extension(std::format(".b{:02d}", segment_index));
-
-        std::ifstream bxx(bxx_path, std::ios::binary);
-        if (!bxx) {
-            throw_system_error(std::format("Failed to open required segment file {}",
-                                           bxx_path.string()));
+int main(int argc, char* argv[]) {
+    try {
+        pil::SquashOptions options;
+        fs::path archive_path;
+        bool watch = false;
+        bool stats = false, stats_json = false;
+        bool show_progress = false, progress_json = false;
+        fs::path trace_path;
+        fs::path metrics_path;
+        fs::path memfd_socket;
+        std::string memfd_command;
+        std::vector<std::string_view> args;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (arg == "--tar" && i + 1 < argc) {
+                archive_path = argv[++i];
+            } else if (arg == "--sparse") {
+                options.sparse = true;
+            } else if (arg == "--index") {
+                options.index = true;
+            } else if (arg == "--simg") {
+                options.simg = true;
+            } else if (arg == "--watch") {
+                watch = true;
+            } else if (arg == "--trace" && i + 1 < argc) {
+                trace_path = argv[++i];
+            } else if (arg == "--metrics" && i + 1 < argc) {
+                metrics_path = argv[++i];
+            } else if (arg == "--progress" || arg == "--progress=json") {
+                show_progress = true;
+                progress_json = arg == "--progress=json";
+            } else if (arg == "--stats" || arg == "--stats=json") {
+                stats = true;
+                stats_json = arg == "--stats=json";
+            } else if (arg == "--memfd-send" && i + 1 < argc) {
+                memfd_socket = argv[++i];
+            } else if (arg == "--memfd-exec" && i + 1 < argc) {
+                memfd_command = argv[++i];
+            } else if (arg == "--cache" && i + 1 < argc) {
+                options.cache_dir = argv[++i];
+            } else if (arg == "--cache-max-size" && i + 1 < argc) {
+                options.cache_max_size = pil::parse_size(argv[++i]);
+            } else {
+                args.push_back(arg);
+            }
         }
-        bxx.exceptions(std::ios::failbit | std::ios::badbit);
-        return read_file_at(bxx, 0, filesz);
-    }
-}
-
-template<typename ElfHeader, typename ElfPhdr>
-void squash_impl(std::ifstream& mdt, std::ofstream& mbn, const fs::path& mdt_path,
-                 bool is_little_endian)
-{
-    auto ehdr = read_elf_header<ElfHeader>(mdt);
-    auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(mdt, ehdr, is_little_endian);
-
-    write_file_at(mbn, 0, std::span{
-        reinterpret_cast<const uint8_t*>(&ehdr),
-        sizeof(ElfHeader)
-    });
-
-    auto phoff = from_file_endian(ehdr.e_phoff, is_little_endian);
-    for (size_t i = 0; i < phdrs.size(); ++i) {
-        write_file_at(mbn, phoff + i * sizeof(ElfPhdr), std::span{
-            reinterpret_cast<const uint8_t*>(&phdrs[i]),
-            sizeof(ElfPhdr)
-        });
-    }
-
-    // Hash segments are stored sequentially in MDT after the first phdr filesz
-    size_t hash_offset = from_file_endian(phdrs[0].p_filesz, is_little_endian);
 
-    for (size_t i = 0; i < phdrs.size(); ++i) {
-        auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
-
-        if (p_filesz == 0) continue;
-
-        auto segment = read_segment_data(mdt, mdt_path, i, p_filesz,
-                                        is_pil_hash_segment(p_flags), hash_offset);
-
-        write_file_at(mbn, p_offset, segment);
-    }
-}
-
-void squash(const fs::path& mdt_path, const fs::path& mbn_path) {
-    if (mdt_path.extension() != ".mdt") {
-        throw Error(std::format("{} is not a .mdt file", mdt_path.string()));
-    }
+        if (args.size() != 2) {
+            auto name = fs::path(argv[0]).filename().string();
+            std::cerr << std::format("Usage: {} [--sparse] [--index] [--simg] [--watch] [--tar <archive>]\n"
+                                     "       {:{}} [--cache <dir> [--cache-max-size <size>]] [--stats[=json]] [--trace <file>]\n"
+                                     "       {:{}} [--progress[=json]] [--metrics <file>]\n"
+                                     "       {:{}} [--memfd-send <socket> | --memfd-exec <command>]\n"
+                                     "       {:{}} <mbn output> <mdt input>\n",
+                                     name, "", name.size(), "", name.size(), "", name.size(),
+                                     "", name.size());
+            return 1;
+        }
 
-    std::ifstream mdt(mdt_path, std::ios::binary);
-    if (!mdt) {
-        throw_system_error(std::format("Failed to open {}", mdt_path.string()));
-    }
-    mdt.exceptions(std::ios::failbit | std::ios::badbit);
+        if (options.simg && (options.index || options.sparse)) {
+            throw pil::Error("--simg cannot be combined with --index or --sparse");
+        }
 
-    std::ofstream mbn(mbn_path, std::ios::binary | std::ios::trunc);
-    if (!mbn) {
-        throw_system_error(std::format("Failed to create {}", mbn_path.string()));
-    }
-    mbn.exceptions(std::ios::failbit | std::ios::badbit);
+        if (watch && (options.simg || !options.cache_dir.empty() || !archive_path.empty())) {
+            throw pil::Error("--watch cannot be combined with --simg, --cache or --tar");
+        }
 
-    auto format = detect_elf_format(mdt);
+        if (watch && (stats || !trace_path.empty() || show_progress)) {
+            throw pil::Error("--stats, --trace and --progress cannot be combined with --watch");
+        }
 
-    if (format.elf_class == ELFCLASS32) {
-        squash_impl<Elf32_Ehdr, Elf32_Phdr>(mdt, mbn, mdt_path, format.is_little_endian);
-    } else if (format.elf_class == ELFCLASS64) {
-        squash_impl<Elf64_Ehdr, Elf64_Phdr>(mdt, mbn, mdt_path, format.is_little_endian);
-    }
-}
+        bool memfd = !memfd_socket.empty() || !memfd_command.empty();
+        if (memfd && (watch || !archive_path.empty())) {
+            throw pil::Error("memfd output cannot be combined with --watch or --tar");
+        }
 
-} // namespace pil
+        if (stats) {
+            pil::stats().enable();
+        }
+        if (!trace_path.empty()) {
+            pil::tracer().enable();
+        }
+        // In watch mode the file is also refreshed while waiting for changes
+        std::optional<pil::MetricsFile> metrics;
+        if (!metrics_path.empty()) {
+            metrics.emplace(metrics_path, watch ? std::chrono::seconds(10) : std::chrono::seconds::zero());
+        }
+        std::optional<pil::ProgressTicker> ticker;
+        if (show_progress) {
+            ticker.emplace(std::cerr, progress_json);
+        }
 
-int main(int argc, char* argv[]) {
-    try {
-        if (argc != 3) {
-            std::cerr << std::format("Usage: {} <mbn output> <mdt input>\n",
-                                     fs::path(argv[0]).filename().string());
-            return 1;
+        if (memfd) {
+            // The mbn output names the memfd
+            auto name = fs::path(args[0]).filename().string();
+            std::vector<pil::MemfdFile> files;
+            files.push_back(pil::squash_to_memfd(args[1], name, options));
+            ticker.reset();
+            if (stats) {
+                pil::stats().report(std::cerr, stats_json);
+            }
+            if (!trace_path.empty()) {
+                pil::tracer().write(trace_path);
+            }
+            if (metrics) {
+                metrics->close();
+            }
+            return pil::hand_off_memfds(files, memfd_socket, memfd_command);
+        } else if (watch) {
+            pil::watch(args[1], args[0], options);
+        } else if (!archive_path.empty()) {
+            pil::squash_from_archive(archive_path, args[1], args[0], options);
+        } else {
+            pil::squash(args[1], args[0], options);
         }
+        ticker.reset();
 
-        pil::squash(argv[2], argv[1]);
+        if (stats) {
+            pil::stats().report(std::cerr, stats_json);
+        }
+        if (!trace_path.empty()) {
+            pil::tracer().write(trace_path);
+        }
+        if (metrics) {
+            metrics->close();
+        }
         return 0;
 
     } catch (const std::ios_base::failure& e) {
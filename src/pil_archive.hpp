@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_ARCHIVE_HPP
+#define PIL_ARCHIVE_HPP
+
+#include <istream>
+#include <ostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <optional>
+
+#include "pil_common.hpp"
+
+namespace pil {
+
+// Sequentially written tar (ustar) or cpio (newc) stream
+
+enum class ArchiveFormat {
+    tar,
+    cpio,
+};
+
+constexpr size_t TAR_BLOCK_SIZE = 512;
+
+class ArchiveWriter {
+public:
+    ArchiveWriter(std::ostream& out, ArchiveFormat format)
+        : out_(out), format_(format) {}
+
+    void add_member(std::string_view name, std::span<const uint8_t> data) {
+        if (format_ == ArchiveFormat::tar) {
+            write_tar_header(name, data.size());
+            write_padded(data, TAR_BLOCK_SIZE);
+        } else {
+            write_cpio_header(name, data.size(), next_ino_++);
+            write_padded(data, 4);
+        }
+    }
+
+    // Writes the end-of-archive marker; no members may be added afterwards
+    void finish() {
+        if (format_ == ArchiveFormat::tar) {
+            write_zeros(2 * TAR_BLOCK_SIZE);
+        } else {
+            write_cpio_header("TRAILER!!!", 0, 0);
+        }
+        out_.flush();
+    }
+
+private:
+    void write_tar_header(std::string_view name, uint64_t size) {
+        std::array<char, TAR_BLOCK_SIZE> hdr{};
+
+        // Names over 100 bytes are split at a '/' into the ustar prefix field
+        std::string_view prefix;
+        if (name.size() > 100) {
+            auto slash = name.find('/', name.size() - 101);
+            if (slash == std::string_view::npos || slash > 155 || slash == 0) {
+                throw Error(std::format("Archive member name too long: {}", name));
+            }
+            prefix = name.substr(0, slash);
+            name = name.substr(slash + 1);
+        }
+
+        std::ranges::copy(name, hdr.begin());
+        put_octal(std::span{hdr}.subspan(100, 8), 0644);
+        put_octal(std::span{hdr}.subspan(108, 8), 0);
+        put_octal(std::span{hdr}.subspan(116, 8), 0);
+        put_size(std::span{hdr}.subspan(124, 12), size);
+        put_octal(std::span{hdr}.subspan(136, 12), 0);
+        hdr[156] = '0';
+        std::ranges::copy(std::string_view{"ustar\0" "00", 8}, hdr.begin() + 257);
+        std::ranges::copy(prefix, hdr.begin() + 345);
+
+        // Checksum is computed with the checksum field itself set to spaces
+        std::fill_n(hdr.begin() + 148, 8, ' ');
+        unsigned checksum = 0;
+        for (char c : hdr) {
+            checksum += static_cast<uint8_t>(c);
+        }
+        auto chksum = std::format("{:06o}", checksum);
+        std::ranges::copy(chksum, hdr.begin() + 148);
+        hdr[154] = '\0';
+
+        out_.write(hdr.data(), hdr.size());
+    }
+
+    void write_cpio_header(std::string_view name, uint64_t size, uint32_t ino) {
+        if (size > UINT32_MAX) {
+            throw Error(std::format("{} is too large for a cpio archive", name));
+        }
+
+        auto hdr = std::format("070701{:08X}{:08X}{:08X}{:08X}{:08X}{:08X}{:08X}"
+                               "{:08X}{:08X}{:08X}{:08X}{:08X}{:08X}",
+                               ino, 0100644u, 0u, 0u, 1u, 0u, size,
+                               0u, 0u, 0u, 0u, name.size() + 1, 0u);
+        hdr.append(name);
+        hdr.push_back('\0');
+
+        write_padded(std::span{reinterpret_cast<const uint8_t*>(hdr.data()), hdr.size()}, 4);
+    }
+
+    static void put_octal(std::span<char> field, uint64_t value) {
+        auto digits = std::format("{:0{}o}", value, field.size() - 1);
+        std::ranges::copy(digits, field.begin());
+        field.back() = '\0';
+    }
+
+    // Sizes beyond 11 octal digits use the GNU base-256 encoding
+    static void put_size(std::span<char> field, uint64_t size) {
+        if (size < (1ULL << 33)) {
+            put_octal(field, size);
+            return;
+        }
+        std::ranges::fill(field, '\0');
+        field[0] = static_cast<char>(0x80);
+        for (size_t i = field.size() - 1; i > 0 && size != 0; --i, size >>= 8) {
+            field[i] = static_cast<char>(size & 0xFF);
+        }
+    }
+
+    void write_padded(std::span<const uint8_t> data, size_t alignment) {
+        ScopedIo timed(IoOp::write);
+        out_.write(reinterpret_cast<const char*>(data.data()), data.size());
+        stats().count_write(data.size());
+        write_zeros((alignment - data.size() % alignment) % alignment);
+    }
+
+    void write_zeros(size_t count) {
+        static constexpr std::array<char, TAR_BLOCK_SIZE> zeros{};
+        while (count > 0) {
+            auto chunk = std::min(count, zeros.size());
+            out_.write(zeros.data(), chunk);
+            count -= chunk;
+        }
+    }
+
+    std::ostream& out_;
+    ArchiveFormat format_;
+    uint32_t next_ino_ = 1;
+};
+
+// Read-side index of a tar archive. Members are uncompressed and contiguous,
+// so each one is served in place from its data offset.
+
+struct ArchiveMember {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// GNU long names and pax records are small; anything larger is not a tar
+// archive worth reading
+constexpr uint64_t TAR_MAX_EXTENDED_HEADER = 1 << 20;
+
+class TarIndex {
+public:
+    // Walks the member headers once, skipping over the data
+    explicit TarIndex(std::istream& in) {
+        std::string long_name;
+        std::optional<uint64_t> pax_size;
+        uint64_t pos = 0;
+
+        in.seekg(0, std::ios::end);
+        uint64_t archive_size = static_cast<uint64_t>(in.tellg());
+
+        // Some writers omit the two zero blocks, so EOF also ends the walk
+        while (pos + TAR_BLOCK_SIZE <= archive_size) {
+            auto hdr = read_file_at(in, pos, TAR_BLOCK_SIZE);
+            if (std::ranges::all_of(hdr, [](uint8_t b) { return b == 0; })) {
+                break;
+            }
+            if (!checksum_matches(hdr)) {
+                if (pos == 0 && hdr[0] == 0x1F && hdr[1] == 0x8B) {
+                    throw Error("Compressed tar archives are not supported; decompress first");
+                }
+                throw Error(std::format("Bad tar header checksum at offset {}", pos));
+            }
+
+            auto size = pax_size.value_or(parse_number(std::span{hdr}.subspan(124, 12)));
+            uint64_t data = pos + TAR_BLOCK_SIZE;
+            char type = static_cast<char>(hdr[156]);
+
+            // Checked before anything is read or skipped, so a hostile size
+            // can neither wrap the offsets nor move the walk backwards
+            if (size > archive_size - data) {
+                auto name = long_name.empty() ? header_name(hdr) : long_name;
+                throw Error(std::format("Truncated tar member {} at offset {}", name, pos));
+            }
+
+            if (type == 'L' || type == 'x') {
+                if (size > TAR_MAX_EXTENDED_HEADER) {
+                    throw Error(std::format("Oversized tar extended header at offset {}", pos));
+                }
+                if (type == 'L') {
+                    long_name = field_string(read_file_at(in, data, size));
+                } else {
+                    parse_pax(read_file_at(in, data, size), long_name, pax_size);
+                }
+            } else {
+                if (type == '0' || type == '\0' || type == '7') {
+                    auto name = long_name.empty() ? header_name(hdr) : long_name;
+                    members_[normalize(name)] = ArchiveMember{data, size};
+                }
+                long_name.clear();
+                pax_size.reset();
+            }
+
+            // size fits in the archive, so this neither overflows nor
+            // goes backwards; past the end, the loop condition ends the walk
+            pos = data + (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        }
+    }
+
+    auto find(std::string_view name) const -> const ArchiveMember* {
+        auto it = members_.find(normalize(std::string(name)));
+        return it != members_.end() ? &it->second : nullptr;
+    }
+
+    auto members() const -> const std::map<std::string, ArchiveMember>& {
+        return members_;
+    }
+
+private:
+    static bool checksum_matches(std::span<const uint8_t> hdr) {
+        unsigned sum = 0;
+        for (size_t i = 0; i < hdr.size(); ++i) {
+            sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+        }
+        return sum == parse_number(hdr.subspan(148, 8));
+    }
+
+    static uint64_t parse_number(std::span<const uint8_t> field) {
+        uint64_t value = 0;
+        if (field[0] & 0x80) {
+            for (size_t i = 1; i < field.size(); ++i) {
+                value = (value << 8) | field[i];
+            }
+            return value;
+        }
+        size_t i = 0;
+        while (i < field.size() && field[i] == ' ') ++i;
+        for (; i < field.size() && field[i] >= '0' && field[i] <= '7'; ++i) {
+            value = value * 8 + (field[i] - '0');
+        }
+        return value;
+    }
+
+    static std::string field_string(std::span<const uint8_t> field) {
+        auto end = std::ranges::find(field, 0);
+        return std::string(field.begin(), end);
+    }
+
+    static std::string header_name(std::span<const uint8_t> hdr) {
+        auto name = field_string(hdr.subspan(0, 100));
+        if (std::memcmp(hdr.data() + 257, "ustar", 5) == 0) {
+            auto prefix = field_string(hdr.subspan(345, 155));
+            if (!prefix.empty()) {
+                return prefix + "/" + name;
+            }
+        }
+        return name;
+    }
+
+    // pax extended headers are "<len> <key>=<value>\n" records
+    static void parse_pax(std::span<const uint8_t> data, std::string& path,
+                          std::optional<uint64_t>& size)
+    {
+        std::string_view records(reinterpret_cast<const char*>(data.data()), data.size());
+        while (!records.empty()) {
+            size_t len = 0;
+            auto space = records.find(' ');
+            if (space == std::string_view::npos) break;
+            for (char c : records.substr(0, space)) {
+                len = len * 10 + (c - '0');
+            }
+            if (len <= space + 1 || len > records.size()) break;
+
+            auto record = records.substr(space + 1, len - space - 2);
+            auto eq = record.find('=');
+            if (eq != std::string_view::npos) {
+                auto key = record.substr(0, eq);
+                auto value = record.substr(eq + 1);
+                if (key == "path") {
+                    path = value;
+                } else if (key == "size") {
+                    size = std::stoull(std::string(value));
+                }
+            }
+            records.remove_prefix(len);
+        }
+    }
+
+    static std::string normalize(std::string name) {
+        while (name.starts_with("./")) {
+            name.erase(0, 2);
+        }
+        return name;
+    }
+
+    std::map<std::string, ArchiveMember> members_;
+};
+
+} // namespace pil
+
+#endif // PIL_ARCHIVE_HPP
@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_BENCH_HPP
+#define PIL_BENCH_HPP
+
+#include <map>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <variant>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+
+#include "pil_common.hpp"
+#include "pil_stats.hpp"
+
+#ifdef __linux__
+#include "pil_fd.hpp"
+
+#include <array>
+#include <optional>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace pil {
+
+// Benchmark harness plumbing: latency statistics, timing helpers and the
+// flat JSON records results are stored as. Every record is one JSON object
+// of string and number fields on its own line, so result files stay
+// diffable and are read back without a JSON library.
+
+// Nearest-rank percentile of a sample, p in [0, 100]
+inline double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) {
+        return 0;
+    }
+    std::ranges::sort(samples);
+    auto rank = static_cast<size_t>(std::ceil(p / 100 * samples.size()));
+    return samples[std::clamp<size_t>(rank, 1, samples.size()) - 1];
+}
+
+// Keeps a computed value alive so the loop producing it is not optimized out
+template<typename T>
+inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Best wall time in nanoseconds over several runs of body; the minimum is
+// the least disturbed by the scheduler and cache state
+template<typename Body>
+double best_time_ns(size_t runs, Body&& body) {
+    double best = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        best = std::min(best, std::chrono::duration<double, std::nano>(
+                                  std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+#ifdef __linux__
+// perf_event_open counters for the calling process and every thread it
+// starts afterwards. Events the machine or kernel does not offer (no PMU in
+// a VM, perf_event_paranoid) are left out rather than failing the run; with
+// kernel profiling restricted, counts fall back to user space only.
+class PerfCounters {
+public:
+    enum Event { cycles, user_cycles, instructions, cache_misses, page_faults,
+                 context_switches, EVENT_COUNT };
+
+    PerfCounters() {
+        open(cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, false);
+        open(user_cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, true);
+        open(instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, false);
+        open(cache_misses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, false);
+        open(page_faults, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, false);
+        open(context_switches, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, false);
+    }
+
+    void start() noexcept {
+        for (const auto& fd : fds_) {
+            if (fd) {
+                ::ioctl(fd.get(), PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(fd.get(), PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void stop() noexcept {
+        for (const auto& fd : fds_) {
+            if (fd) ::ioctl(fd.get(), PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    // Whether the event counted kernel time too
+    bool with_kernel(Event event) const { return with_kernel_[event]; }
+
+    // Count scaled up for the time the event was multiplexed out, if the
+    // event is available. Threads that have exited are included.
+    auto value(Event event) const -> std::optional<double> {
+        struct { uint64_t value, enabled, running; } data{};
+        if (!fds_[event] || ::read(fds_[event].get(), &data, sizeof(data)) != sizeof(data) ||
+            data.running == 0) {
+            return std::nullopt;
+        }
+        return static_cast<double>(data.value) * data.enabled / data.running;
+    }
+
+private:
+    void open(Event event, uint32_t type, uint64_t config, bool user_only) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_hv = 1;
+        attr.exclude_kernel = user_only;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        int fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        if (fd < 0 && !user_only && (errno == EACCES || errno == EPERM)) {
+            attr.exclude_kernel = 1;
+            fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        }
+        fds_[event] = UniqueFd(fd);
+        with_kernel_[event] = fd >= 0 && !attr.exclude_kernel;
+    }
+
+    std::array<UniqueFd, EVENT_COUNT> fds_;
+    std::array<bool, EVENT_COUNT> with_kernel_{};
+};
+#endif
+
+using RecordValue = std::variant<std::string, double>;
+
+// One flat JSON object; fields keep their insertion order
+class Record {
+public:
+    Record& set(std::string key, RecordValue value) {
+        auto it = std::ranges::find(fields_, key, &Field::first);
+        if (it != fields_.end()) {
+            it->second = std::move(value);
+        } else {
+            fields_.emplace_back(std::move(key), std::move(value));
+        }
+        return *this;
+    }
+
+    const RecordValue* get(std::string_view key) const {
+        auto it = std::ranges::find(fields_, key, &Field::first);
+        return it == fields_.end() ? nullptr : &it->second;
+    }
+
+    std::string text(std::string_view key) const {
+        auto value = get(key);
+        return value && std::holds_alternative<std::string>(*value) ? std::get<std::string>(*value)
+                                                                    : std::string();
+    }
+
+    double number(std::string_view key) const {
+        auto value = get(key);
+        return value && std::holds_alternative<double>(*value) ? std::get<double>(*value) : 0;
+    }
+
+    std::string to_json() const {
+        std::string out = "{";
+        for (const auto& [key, value] : fields_) {
+            out += std::format("{}\"{}\": ", out.size() > 1 ? ", " : "", key);
+            if (auto s = std::get_if<std::string>(&value)) {
+                out += quote(*s);
+            } else {
+                double d = std::get<double>(value);
+                out += d == std::floor(d) && std::abs(d) < 1e15 ? std::format("{}", static_cast<int64_t>(d))
+                                                               : std::format("{:.6g}", d);
+            }
+        }
+        return out + "}";
+    }
+
+    // Parses what to_json() writes
+    static Record from_json(std::string_view json) {
+        Record record;
+        size_t pos = 0;
+        auto skip = [&] {
+            while (pos < json.size() && (json[pos] == ' ' || json[pos] == ',' || json[pos] == '{')) ++pos;
+        };
+
+        while (true) {
+            skip();
+            if (pos >= json.size() || json[pos] == '}') break;
+
+            auto key = unquote(json, pos);
+            while (pos < json.size() && (json[pos] == ':' || json[pos] == ' ')) ++pos;
+            if (pos < json.size() && json[pos] == '"') {
+                record.set(key, unquote(json, pos));
+            } else {
+                size_t end = json.find_first_of(",}", pos);
+                record.set(key, std::stod(std::string(json.substr(pos, end - pos))));
+                pos = end;
+            }
+        }
+        return record;
+    }
+
+private:
+    using Field = std::pair<std::string, RecordValue>;
+
+    static std::string quote(std::string_view s) {
+        std::string out = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    static std::string unquote(std::string_view json, size_t& pos) {
+        if (pos >= json.size() || json[pos] != '"') {
+            throw Error("Malformed benchmark record");
+        }
+        std::string out;
+        for (++pos; pos < json.size() && json[pos] != '"'; ++pos) {
+            if (json[pos] == '\\' && pos + 1 < json.size()) ++pos;
+            out += json[pos];
+        }
+        ++pos;
+        return out;
+    }
+
+    std::vector<Field> fields_;
+};
+
+// Result files: a JSON array with one record per line
+inline void write_records(const std::filesystem::path& path, const std::vector<Record>& records) {
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) {
+        throw_system_error(std::format("Failed to create {}", path.string()));
+    }
+    out << "[\n";
+    for (size_t i = 0; i < records.size(); ++i) {
+        out << "  " << records[i].to_json() << (i + 1 < records.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+}
+
+inline auto read_records(const std::filesystem::path& path) -> std::vector<Record> {
+    std::ifstream in(path);
+    if (!in) {
+        throw_system_error(std::format("Failed to open {}", path.string()));
+    }
+
+    std::vector<Record> records;
+    std::string line;
+    while (std::getline(in, line)) {
+        auto start = line.find('{');
+        if (start != std::string::npos) {
+            records.push_back(Record::from_json(std::string_view(line).substr(start)));
+        }
+    }
+    return records;
+}
+
+} // namespace pil
+
+#endif // PIL_BENCH_HPP
@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_BUNDLE_HPP
+#define PIL_BUNDLE_HPP
+
+#include <map>
+#include <algorithm>
+#include <string>
+#include <streambuf>
+#include <filesystem>
+
+#include "pil_common.hpp"
+#include "pil_fd.hpp"
+#include "pil_sha256.hpp"
+
+namespace pil {
+
+// Multi-image bundle: many mbn images in one file, with each distinct segment
+// stored once no matter how many images share it.
+//
+//   BundleHeader | blob data ... | BlobRecord[blob_count]
+//   | BundleImageRecord[image_count] | PieceRecord[piece_count] | strings
+//
+// Every image is a list of pieces (its ELF headers, then each segment) that
+// point at blobs. Blobs start on 4 KiB boundaries so they can be mapped and
+// copied in page units. The directory follows the data so the bundle is
+// written in a single sequential pass. All fields are little-endian.
+
+constexpr std::array<uint8_t, 8> PIL_BUNDLE_MAGIC = {'P', 'I', 'L', 'B', 'N', 'D', 'L', 1};
+constexpr size_t BUNDLE_HEADER_SIZE = 32;
+constexpr size_t BUNDLE_BLOB_RECORD_SIZE = 48;
+constexpr size_t BUNDLE_IMAGE_RECORD_SIZE = 24;
+constexpr size_t BUNDLE_PIECE_RECORD_SIZE = 24;
+constexpr size_t BUNDLE_BLOB_ALIGNMENT = 4096;
+
+struct BundlePiece {
+    uint64_t offset;    // within the image
+    uint64_t size;
+    uint32_t blob;
+};
+
+class BundleWriter {
+public:
+    explicit BundleWriter(const std::filesystem::path& path)
+        : out_(path, std::ios::binary | std::ios::trunc)
+    {
+        if (!out_) {
+            throw_system_error(std::format("Failed to create {}", path.string()));
+        }
+        out_.exceptions(std::ios::failbit | std::ios::badbit);
+
+        // Placeholder; finish() fills in the counts and directory offset
+        write_file_at(out_, 0, std::vector<uint8_t>(BUNDLE_HEADER_SIZE));
+        pos_ = BUNDLE_HEADER_SIZE;
+    }
+
+    void add_image(const std::string& name, const std::filesystem::path& mbn_path) {
+        for (const auto& image : images_) {
+            if (image.name == name) {
+                throw Error(std::format("Duplicate bundle member {}", name));
+            }
+        }
+
+        std::ifstream mbn(mbn_path, std::ios::binary);
+        if (!mbn) {
+            throw_system_error(std::format("Failed to open {}", mbn_path.string()));
+        }
+        mbn.exceptions(std::ios::failbit | std::ios::badbit);
+
+        auto format = detect_elf_format(mbn);
+        if (format.elf_class == ELFCLASS32) {
+            add_image_impl<Elf32_Ehdr, Elf32_Phdr>(name, mbn, format.is_little_endian);
+        } else {
+            add_image_impl<Elf64_Ehdr, Elf64_Phdr>(name, mbn, format.is_little_endian);
+        }
+    }
+
+    void finish() {
+        std::vector<uint8_t> dir;
+        std::string strings;
+
+        for (const auto& blob : blobs_) {
+            append_le<uint64_t>(dir, blob.offset);
+            append_le<uint64_t>(dir, blob.size);
+            dir.insert(dir.end(), blob.digest.begin(), blob.digest.end());
+        }
+
+        uint32_t first_piece = 0;
+        for (const auto& image : images_) {
+            append_le<uint32_t>(dir, static_cast<uint32_t>(strings.size()));
+            append_le<uint32_t>(dir, static_cast<uint32_t>(image.name.size()));
+            append_le<uint32_t>(dir, first_piece);
+            append_le<uint32_t>(dir, static_cast<uint32_t>(image.pieces.size()));
+            append_le<uint64_t>(dir, image.size);
+            strings += image.name;
+            first_piece += static_cast<uint32_t>(image.pieces.size());
+        }
+
+        for (const auto& image : images_) {
+            for (const auto& piece : image.pieces) {
+                append_le<uint64_t>(dir, piece.offset);
+                append_le<uint64_t>(dir, piece.size);
+                append_le<uint32_t>(dir, piece.blob);
+                append_le<uint32_t>(dir, 0);
+            }
+        }
+        dir.insert(dir.end(), strings.begin(), strings.end());
+
+        uint64_t directory_offset = pos_;
+        write_file_at(out_, pos_, dir);
+
+        std::vector<uint8_t> hdr(PIL_BUNDLE_MAGIC.begin(), PIL_BUNDLE_MAGIC.end());
+        append_le<uint32_t>(hdr, static_cast<uint32_t>(images_.size()));
+        append_le<uint32_t>(hdr, static_cast<uint32_t>(blobs_.size()));
+        append_le<uint32_t>(hdr, first_piece);
+        append_le<uint32_t>(hdr, static_cast<uint32_t>(strings.size()));
+        append_le<uint64_t>(hdr, directory_offset);
+        write_file_at(out_, 0, hdr);
+        out_.flush();
+    }
+
+    size_t blob_count() const { return blobs_.size(); }
+    uint64_t deduplicated_bytes() const { return deduplicated_; }
+
+private:
+    struct Blob {
+        uint64_t offset;
+        uint64_t size;
+        Sha256::Digest digest;
+    };
+
+    struct Image {
+        std::string name;
+        uint64_t size;
+        std::vector<BundlePiece> pieces;
+    };
+
+    template<typename ElfHeader, typename ElfPhdr>
+    void add_image_impl(const std::string& name, std::istream& mbn, bool is_little_endian) {
+        auto ehdr = read_elf_header<ElfHeader>(mbn);
+        auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(mbn, ehdr, is_little_endian);
+        Image image{name, header_block_size<ElfHeader, ElfPhdr>(ehdr, phdrs.size(), is_little_endian),
+                    {}};
+        image.pieces.push_back({0, image.size, store(read_file_at(mbn, 0, image.size))});
+
+        for (size_t i = 0; i < phdrs.size(); ++i) {
+            auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
+
+            if (p_filesz == 0) continue;
+
+            image.pieces.push_back({p_offset, p_filesz, store(read_file_at(mbn, p_offset, p_filesz))});
+            image.size = std::max<uint64_t>(image.size, p_offset + p_filesz);
+        }
+
+        images_.push_back(std::move(image));
+    }
+
+    uint32_t store(std::span<const uint8_t> data) {
+        auto digest = Sha256::of(data);
+        if (auto it = blob_ids_.find(digest); it != blob_ids_.end()) {
+            deduplicated_ += data.size();
+            return it->second;
+        }
+
+        pos_ = (pos_ + BUNDLE_BLOB_ALIGNMENT - 1) / BUNDLE_BLOB_ALIGNMENT * BUNDLE_BLOB_ALIGNMENT;
+        write_file_at(out_, pos_, data);
+
+        auto id = static_cast<uint32_t>(blobs_.size());
+        blobs_.push_back({pos_, data.size(), digest});
+        blob_ids_.emplace(digest, id);
+        pos_ += data.size();
+        return id;
+    }
+
+    std::ofstream out_;
+    uint64_t pos_ = 0;
+    std::vector<Blob> blobs_;
+    std::map<Sha256::Digest, uint32_t> blob_ids_;
+    std::vector<Image> images_;
+    uint64_t deduplicated_ = 0;
+};
+
+// Mapped, validated view of a bundle
+class Bundle {
+public:
+    struct Image {
+        std::string_view name;
+        uint64_t size;
+        std::vector<BundlePiece> pieces;    // as stored, in phdr order
+        std::vector<ImagePiece> layout;     // resolved: disjoint, sorted, source is the blob
+    };
+
+    explicit Bundle(const std::filesystem::path& path) : path_(path), file_(path) {
+        auto data = file_.data();
+        if (file_.size() < BUNDLE_HEADER_SIZE ||
+            std::memcmp(data, PIL_BUNDLE_MAGIC.data(), PIL_BUNDLE_MAGIC.size()) != 0) {
+            throw Error(std::format("{} is not a PIL bundle", path.string()));
+        }
+
+        auto image_count = load_le<uint32_t>(data + 8);
+        auto blob_count = load_le<uint32_t>(data + 12);
+        auto piece_count = load_le<uint32_t>(data + 16);
+        auto strings_size = load_le<uint32_t>(data + 20);
+        auto directory = load_le<uint64_t>(data + 24);
+
+        uint64_t images_at = directory + uint64_t(blob_count) * BUNDLE_BLOB_RECORD_SIZE;
+        uint64_t pieces_at = images_at + uint64_t(image_count) * BUNDLE_IMAGE_RECORD_SIZE;
+        uint64_t strings_at = pieces_at + uint64_t(piece_count) * BUNDLE_PIECE_RECORD_SIZE;
+        if (directory > file_.size() || strings_at + strings_size > file_.size()) {
+            throw Error(std::format("{} is truncated", path.string()));
+        }
+
+        for (uint32_t i = 0; i < blob_count; ++i) {
+            auto r = data + directory + size_t(i) * BUNDLE_BLOB_RECORD_SIZE;
+            auto offset = load_le<uint64_t>(r);
+            auto size = load_le<uint64_t>(r + 8);
+            if (offset > directory || size > directory - offset) {
+                throw Error(std::format("{}: blob {} out of range", path.string(), i));
+            }
+            blobs_.push_back(std::span{data + offset, size});
+        }
+
+        auto strings = reinterpret_cast<const char*>(data + strings_at);
+        for (uint32_t i = 0; i < image_count; ++i) {
+            auto r = data + images_at + size_t(i) * BUNDLE_IMAGE_RECORD_SIZE;
+            auto name_offset = load_le<uint32_t>(r);
+            auto name_size = load_le<uint32_t>(r + 4);
+            auto first_piece = load_le<uint32_t>(r + 8);
+            auto count = load_le<uint32_t>(r + 12);
+            if (uint64_t(name_offset) + name_size > strings_size ||
+                uint64_t(first_piece) + count > piece_count) {
+                throw Error(std::format("{}: image record {} out of range", path.string(), i));
+            }
+
+            Image image{std::string_view(strings + name_offset, name_size),
+                        load_le<uint64_t>(r + 16), {}};
+            for (uint32_t p = first_piece; p < first_piece + count; ++p) {
+                auto pr = data + pieces_at + size_t(p) * BUNDLE_PIECE_RECORD_SIZE;
+                BundlePiece piece{load_le<uint64_t>(pr), load_le<uint64_t>(pr + 8),
+                                  load_le<uint32_t>(pr + 16)};
+                if (piece.blob >= blobs_.size() || piece.size > blobs_[piece.blob].size() ||
+                    piece.offset > image.size || piece.size > image.size - piece.offset) {
+                    throw Error(std::format("{}: piece {} out of range", path.string(), p));
+                }
+                image.pieces.push_back(piece);
+            }
+
+            std::vector<ImagePiece> writes;
+            writes.reserve(image.pieces.size());
+            for (const auto& piece : image.pieces) {
+                writes.push_back({piece.offset, piece.size, piece.blob, 0});
+            }
+            image.layout = resolve_pieces(writes);
+            images_.push_back(std::move(image));
+        }
+    }
+
+    auto images() const -> const std::vector<Image>& { return images_; }
+    auto blobs() const -> const std::vector<std::span<const uint8_t>>& { return blobs_; }
+
+    auto find(std::string_view name) const -> const Image* {
+        for (const auto& image : images_) {
+            if (image.name == name) return &image;
+        }
+        return nullptr;
+    }
+
+    // Copies [offset, offset + dst.size()) of an image into dst. Later pieces
+    // win where pieces overlap, matching how squash lays out an image; bytes
+    // no piece covers read as zero. Reads past the end are clipped. The
+    // resolved layout is searched, so a read costs O(log n) in the pieces.
+    size_t read(const Image& image, uint64_t offset, std::span<uint8_t> dst) const {
+        if (offset >= image.size) return 0;
+        dst = dst.first(std::min<uint64_t>(dst.size(), image.size - offset));
+        std::ranges::fill(dst, 0);
+
+        uint64_t end = offset + dst.size();
+        auto it = std::ranges::upper_bound(image.layout, offset, {}, &ImagePiece::offset);
+        if (it != image.layout.begin()) --it;
+
+        for (; it != image.layout.end() && it->offset < end; ++it) {
+            uint64_t from = std::max(offset, it->offset);
+            uint64_t to = std::min(end, it->offset + it->size);
+            if (from >= to) continue;
+
+            std::memcpy(dst.data() + (from - offset),
+                        blobs_[it->source].data() + it->source_offset + (from - it->offset),
+                        to - from);
+        }
+        return dst.size();
+    }
+
+private:
+    std::filesystem::path path_;
+    MappedFile file_;
+    std::vector<std::span<const uint8_t>> blobs_;
+    std::vector<Image> images_;
+};
+
+// Seekable stream over one bundle member, so the member can be fed to code
+// that reads an mbn through std::istream
+class BundleImageBuf : public std::streambuf {
+public:
+    BundleImageBuf(const Bundle& bundle, const Bundle::Image& image)
+        : bundle_(bundle), image_(image) {}
+
+protected:
+    int_type underflow() override {
+        auto n = bundle_.read(image_, pos_, std::span{reinterpret_cast<uint8_t*>(buffer_.data()),
+                                                      buffer_.size()});
+        if (n == 0) {
+            return traits_type::eof();
+        }
+        setg(buffer_.data(), buffer_.data(), buffer_.data() + n);
+        pos_ += n;
+        return traits_type::to_int_type(buffer_[0]);
+    }
+
+    std::streamsize xsgetn(char* s, std::streamsize count) override {
+        std::streamsize done = std::min<std::streamsize>(count, egptr() - gptr());
+        std::memcpy(s, gptr(), done);
+        gbump(static_cast<int>(done));
+
+        if (done < count) {
+            auto n = bundle_.read(image_, pos_, std::span{reinterpret_cast<uint8_t*>(s + done),
+                                                          static_cast<size_t>(count - done)});
+            pos_ += n;
+            done += static_cast<std::streamsize>(n);
+        }
+        return done;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+
+        off_type base = dir == std::ios_base::beg ? 0
+                      : dir == std::ios_base::end ? static_cast<off_type>(image_.size)
+                      : static_cast<off_type>(pos_) - (egptr() - gptr());
+        return seekpos(pos_type(base + off), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::in) || off_type(pos) < 0) return pos_type(off_type(-1));
+
+        pos_ = static_cast<uint64_t>(off_type(pos));
+        setg(buffer_.data(), buffer_.data(), buffer_.data());
+        return pos;
+    }
+
+private:
+    const Bundle& bundle_;
+    const Bundle::Image& image_;
+    uint64_t pos_ = 0;      // image offset of egptr()
+    std::array<char, 4096> buffer_;
+};
+
+} // namespace pil
+
+#endif // PIL_BUNDLE_HPP
@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_CACHE_HPP
+#define PIL_CACHE_HPP
+
+#include <string>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+
+#include "pil_common.hpp"
+#include "pil_fd.hpp"
+#include "pil_sha256.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+namespace pil {
+
+// ccache-style result cache. Results live under <dir>/results, named by a key
+// derived from input digests; <dir>/stat remembers each input's digest
+// together with its stat data, so unchanged inputs are never rehashed. A
+// result's mtime is its last use, which drives LRU eviction.
+
+constexpr uint64_t DEFAULT_CACHE_MAX_SIZE = 5ULL << 30;
+
+// Parses sizes such as "512M" or "5G" (binary units)
+inline uint64_t parse_size(std::string_view text) {
+    uint64_t value = 0;
+    size_t i = 0;
+    bool overflow = false;
+    for (; i < text.size() && text[i] >= '0' && text[i] <= '9'; ++i) {
+        unsigned digit = text[i] - '0';
+        overflow |= value > (UINT64_MAX - digit) / 10;
+        value = value * 10 + digit;
+    }
+
+    auto suffix = text.substr(i);
+    int shift = suffix.empty() ? 0
+              : suffix == "K" ? 10
+              : suffix == "M" ? 20
+              : suffix == "G" ? 30
+              : suffix == "T" ? 40
+              : -1;
+    if (i == 0 || shift < 0) {
+        throw Error(std::format("Invalid size {}", text));
+    }
+    if (overflow || value > UINT64_MAX >> shift) {
+        throw Error(std::format("Size {} is too large", text));
+    }
+    return value << shift;
+}
+
+// Makes dst a copy of src: a reflink where the filesystem supports it, and a
+// full copy otherwise. Never a hard link: the output is rewritten in place by
+// later squashes and --watch, which would corrupt a linked cache entry.
+inline void clone_file(const std::filesystem::path& src, const std::filesystem::path& dst) {
+    std::error_code ec;
+    std::filesystem::remove(dst, ec);
+
+#ifdef __linux__
+    {
+        UniqueFd in = open_fd(src, O_RDONLY);
+        UniqueFd out(::open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+        if (in && out) {
+            int saved_errno = errno;
+            bool cloned = ::ioctl(out.get(), FICLONE, in.get()) == 0;
+            errno = saved_errno;
+            if (cloned) {
+                return;
+            }
+        }
+        if (out) {
+            out.reset();
+            std::filesystem::remove(dst, ec);
+        }
+    }
+#endif
+
+    std::filesystem::copy_file(src, dst, std::filesystem::copy_options::overwrite_existing);
+}
+
+class ResultCache {
+public:
+    ResultCache(const std::filesystem::path& dir, uint64_t max_size)
+        : dir_(dir), max_size_(max_size)
+    {
+        std::filesystem::create_directories(dir_ / "results");
+        std::filesystem::create_directories(dir_ / "stat");
+    }
+
+    // Digest of a file's contents, reusing the recorded one while the file's
+    // size, mtime, ctime and inode are unchanged
+    auto file_digest(const std::filesystem::path& path) -> Sha256::Digest {
+        auto abs = std::filesystem::absolute(path);
+        auto record_path = dir_ / "stat" / to_hex(Sha256::of(as_bytes(abs.string())));
+        auto identity = stat_identity(path);
+
+        if (!identity.empty()) {
+            std::ifstream record(record_path);
+            std::string recorded_identity, hex;
+            if (record && std::getline(record, recorded_identity) && std::getline(record, hex) &&
+                recorded_identity == identity && hex.size() == 64) {
+                Sha256::Digest digest;
+                for (size_t i = 0; i < digest.size(); ++i) {
+                    digest[i] = static_cast<uint8_t>(std::stoul(hex.substr(i * 2, 2), nullptr, 16));
+                }
+                return digest;
+            }
+        }
+
+        auto digest = hash_file(path);
+
+        // A file modified within the last second could change again without
+        // its mtime moving, so its digest is not remembered
+        if (!identity.empty() && !recently_modified(path)) {
+            write_atomically(record_path, identity + "\n" + to_hex(digest) + "\n");
+        }
+        return digest;
+    }
+
+    // On a hit, materializes the cached result at output and marks it used
+    bool fetch(const std::string& key, const std::filesystem::path& output) {
+        auto result = dir_ / "results" / key;
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(result, ec)) {
+            return false;
+        }
+
+        clone_file(result, output);
+        std::filesystem::last_write_time(result, std::filesystem::file_time_type::clock::now(), ec);
+        return true;
+    }
+
+    void store(const std::string& key, const std::filesystem::path& output) {
+        auto result = dir_ / "results" / key;
+        auto tmp = result;
+        tmp += tmp_suffix();
+
+        clone_file(output, tmp);
+        std::filesystem::rename(tmp, result);
+        evict();
+    }
+
+private:
+    static std::span<const uint8_t> as_bytes(std::string_view s) {
+        return {reinterpret_cast<const uint8_t*>(s.data()), s.size()};
+    }
+
+    static std::string stat_identity([[maybe_unused]] const std::filesystem::path& path) {
+#if defined(__unix__) || defined(__APPLE__)
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0) {
+            throw_system_error(std::format("Failed to stat {}", path.string()));
+        }
+#ifdef __APPLE__
+        auto mtime = st.st_mtimespec;
+        auto ctime = st.st_ctimespec;
+#else
+        auto mtime = st.st_mtim;
+        auto ctime = st.st_ctim;
+#endif
+        return std::format("{} {}.{} {}.{} {} {}", st.st_size, mtime.tv_sec, mtime.tv_nsec,
+                           ctime.tv_sec, ctime.tv_nsec, st.st_ino, st.st_dev);
+#else
+        return {};
+#endif
+    }
+
+    static bool recently_modified(const std::filesystem::path& path) {
+        auto mtime = std::filesystem::last_write_time(path);
+        return std::filesystem::file_time_type::clock::now() - mtime < std::chrono::seconds(1);
+    }
+
+    static Sha256::Digest hash_file(const std::filesystem::path& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw_system_error(std::format("Failed to open {}", path.string()));
+        }
+
+        Sha256 sha;
+        std::vector<char> buffer(1 << 20);
+        while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
+            sha.update(std::span{reinterpret_cast<const uint8_t*>(buffer.data()),
+                                 static_cast<size_t>(in.gcount())});
+        }
+        if (in.bad()) {
+            throw_system_error(std::format("Failed to read {}", path.string()));
+        }
+        return sha.finish();
+    }
+
+    // Concurrent writers of the same record each finish their own temporary
+    // file, so whichever rename lands last leaves a whole record
+    static void write_atomically(const std::filesystem::path& path, const std::string& content) {
+        auto tmp = path;
+        tmp += tmp_suffix();
+        std::error_code ec;
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << content;
+            out.close();
+            if (!out) {
+                std::filesystem::remove(tmp, ec);
+                return;
+            }
+        }
+        std::filesystem::rename(tmp, path, ec);
+        if (ec) {
+            std::filesystem::remove(tmp, ec);
+        }
+    }
+
+    // Unique across processes and across calls within one
+    static std::string tmp_suffix() {
+#if defined(__unix__) || defined(__APPLE__)
+        auto pid = ::getpid();
+#else
+        int pid = 0;
+#endif
+        return std::format(".tmp{}.{}", pid,
+                           std::chrono::steady_clock::now().time_since_epoch().count());
+    }
+
+    void evict() {
+        struct Entry {
+            std::filesystem::path path;
+            std::filesystem::file_time_type used;
+            uint64_t size;
+        };
+
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(dir_ / "results", ec)) {
+            if (!entry.is_regular_file(ec) || entry.path().string().find(".tmp") != std::string::npos) {
+                continue;
+            }
+            auto size = entry.file_size(ec);
+            entries.push_back({entry.path(), entry.last_write_time(ec), size});
+            total += size;
+        }
+
+        std::ranges::sort(entries, {}, &Entry::used);
+        for (const auto& entry : entries) {
+            if (total <= max_size_) break;
+            std::filesystem::remove(entry.path, ec);
+            total -= entry.size;
+        }
+    }
+
+    std::filesystem::path dir_;
+    uint64_t max_size_;
+};
+
+} // namespace pil
+
+#endif // PIL_CACHE_HPP
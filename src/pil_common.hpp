@@ -7,6 +7,7 @@
 
 #include <fstream>
 #include <vector>
+#include <map>
 #include <array>
 #include <system_error>
 #include <format>
@@ -14,9 +15,16 @@
 #include <bit>
 #include <cstring>
 #include <cerrno>
+#include <optional>
+#include <filesystem>
+#include <type_traits>
 
 #include "elf.h"
 #include "endian_utils.hpp"
+#include "pil_stats.hpp"
+#include "pil_trace.hpp"
+#include "pil_progress.hpp"
+#include "pil_probes.hpp"
 
 namespace pil {
 
@@ -25,10 +33,14 @@ namespace pil {
 constexpr uint32_t PIL_SEGMENT_TYPE_SHIFT = 24;
 constexpr uint32_t PIL_SEGMENT_TYPE_MASK = 7;
 constexpr uint32_t PIL_SEGMENT_TYPE_HASH = 2;
+constexpr uint32_t PIL_SEGMENT_TYPE_PHDR = 7;  // the segment covering the headers
+
+inline uint32_t pil_segment_type(uint32_t p_flags) {
+    return (p_flags >> PIL_SEGMENT_TYPE_SHIFT) & PIL_SEGMENT_TYPE_MASK;
+}
 
 inline bool is_pil_hash_segment(uint32_t p_flags) {
-    return ((p_flags >> PIL_SEGMENT_TYPE_SHIFT) & PIL_SEGMENT_TYPE_MASK)
-           == PIL_SEGMENT_TYPE_HASH;
+    return pil_segment_type(p_flags) == PIL_SEGMENT_TYPE_HASH;
 }
 
 // Error handling
@@ -47,28 +59,34 @@ struct Error : std::runtime_error {
 
 // File I/O utilities
 
-inline auto read_file_at(std::ifstream& file, size_t offset, size_t size)
-    -> std::vector<uint8_t>
-{
-    std::vector<uint8_t> buffer(size);
-
+inline void read_file_into(std::istream& file, size_t offset, std::span<uint8_t> buffer) {
+    ScopedIo timed(IoOp::read);
     file.seekg(offset);
-    file.read(reinterpret_cast<char*>(buffer.data()), size);
+    file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+    stats().count_read(buffer.size());
 
-    if (file.gcount() != static_cast<std::streamsize>(size)) {
+    if (file.gcount() != static_cast<std::streamsize>(buffer.size())) {
         throw Error(std::format("Incomplete read: expected {} bytes, got {} bytes at offset {}",
-                               size, file.gcount(), offset));
+                               buffer.size(), file.gcount(), offset));
     }
+}
 
+inline auto read_file_at(std::istream& file, size_t offset, size_t size)
+    -> std::vector<uint8_t>
+{
+    std::vector<uint8_t> buffer(size);
+    read_file_into(file, offset, buffer);
     return buffer;
 }
 
 template<typename T>
-auto read_struct_at(std::ifstream& file, size_t offset) -> T {
+auto read_struct_at(std::istream& file, size_t offset) -> T {
     std::array<uint8_t, sizeof(T)> raw;
 
+    ScopedIo timed(IoOp::read);
     file.seekg(offset);
     file.read(reinterpret_cast<char*>(raw.data()), sizeof(T));
+    stats().count_read(sizeof(T));
 
     if (file.gcount() != sizeof(T)) {
         throw Error(std::format("Incomplete read: expected {} bytes, got {} bytes at offset {}",
@@ -79,13 +97,42 @@ auto read_struct_at(std::ifstream& file, size_t offset) -> T {
 }
 
 inline void write_file_at(std::ofstream& file, size_t offset, std::span<const uint8_t> data) {
+    ScopedIo timed(IoOp::write);
     file.seekp(offset);
     file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    stats().count_write(data.size());
 }
 
 inline void append_to_file(std::ofstream& file, std::span<const uint8_t> data) {
+    ScopedIo timed(IoOp::write);
     file.seekp(0, std::ios::end);
     file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    stats().count_write(data.size());
+}
+
+// Fixed little-endian encoding for the tools' own on-disk formats
+
+template<std::integral T>
+void append_le(std::vector<uint8_t>& out, T value) {
+    value = from_file_endian(value, true);
+    auto bytes = std::bit_cast<std::array<uint8_t, sizeof(T)>>(value);
+    out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+template<std::integral T>
+T load_le(const uint8_t* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return from_file_endian(value, true);
+}
+
+// Path of the bXX file holding a segment of a split image
+inline auto segment_path(const std::filesystem::path& mdt_path, size_t segment_index)
+    -> std::filesystem::path
+{
+    auto bxx_path = mdt_path;
+    bxx_path.replace_extension(std::format(".b{:02d}", segment_index));
+    return bxx_path;
 }
 
 // ELF parsing utilities
@@ -95,7 +142,7 @@ struct ElfFormat {
     bool is_little_endian;
 };
 
-inline ElfFormat detect_elf_format(std::ifstream& file) {
+inline ElfFormat detect_elf_format(std::istream& file) {
     uint8_t e_ident[EI_NIDENT];
     file.seekg(0);
     file.read(reinterpret_cast<char*>(e_ident), EI_NIDENT);
@@ -121,25 +168,106 @@ inline ElfFormat detect_elf_format(std::ifstream& file) {
 }
 
 template<typename ElfHeader>
-ElfHeader read_elf_header(std::ifstream& file) {
+ElfHeader read_elf_header(std::istream& file) {
     return read_struct_at<ElfHeader>(file, 0);
 }
 
+template<typename ElfHeader>
+using ElfShdr = std::conditional_t<std::is_same_v<ElfHeader, Elf64_Ehdr>, Elf64_Shdr, Elf32_Shdr>;
+
+// With PN_XNUM in e_phnum, the real program header count is in sh_info of
+// section header 0. Returns that header, or nullopt for the usual case.
+template<typename ElfHeader>
+auto read_xnum_section_header(std::istream& file, const ElfHeader& ehdr, bool is_little_endian)
+    -> std::optional<ElfShdr<ElfHeader>>
+{
+    if (from_file_endian(ehdr.e_phnum, is_little_endian) != PN_XNUM) {
+        return std::nullopt;
+    }
+    auto shoff = from_file_endian(ehdr.e_shoff, is_little_endian);
+    if (shoff == 0) {
+        throw Error("e_phnum is PN_XNUM but there is no section header 0");
+    }
+    return read_struct_at<ElfShdr<ElfHeader>>(file, shoff);
+}
+
+template<typename ElfHeader>
+size_t program_header_count(std::istream& file, const ElfHeader& ehdr, bool is_little_endian) {
+    if (auto shdr = read_xnum_section_header(file, ehdr, is_little_endian)) {
+        return from_file_endian(shdr->sh_info, is_little_endian);
+    }
+    return from_file_endian(ehdr.e_phnum, is_little_endian);
+}
+
 template<typename ElfHeader, typename ElfPhdr>
-auto read_program_headers(std::ifstream& file, const ElfHeader& ehdr, bool is_little_endian)
+auto read_program_headers(std::istream& file, const ElfHeader& ehdr, bool is_little_endian)
     -> std::vector<ElfPhdr>
 {
     auto phoff = from_file_endian(ehdr.e_phoff, is_little_endian);
-    auto phnum = from_file_endian(ehdr.e_phnum, is_little_endian);
+    auto phnum = program_header_count(file, ehdr, is_little_endian);
+    if (phnum == 0) {
+        return {};
+    }
 
-    std::vector<ElfPhdr> phdrs(phnum);
-    for (size_t i = 0; i < phnum; ++i) {
-        phdrs[i] = read_struct_at<ElfPhdr>(file, phoff + i * sizeof(ElfPhdr));
+    // A PN_XNUM count is 32 bits wide; check it against the file before
+    // allocating for it
+    file.seekg(0, std::ios::end);
+    uint64_t file_size = static_cast<uint64_t>(file.tellg());
+    if (phoff > file_size || phnum > (file_size - phoff) / sizeof(ElfPhdr)) {
+        throw Error(std::format("Program header table ({} entries at offset {}) runs past the end "
+                                "of the file", phnum, phoff));
     }
 
+    // The table is contiguous, so it is read in one go
+    std::vector<ElfPhdr> phdrs(phnum);
+    read_file_into(file, phoff, std::span{reinterpret_cast<uint8_t*>(phdrs.data()),
+                                          phnum * sizeof(ElfPhdr)});
     return phdrs;
 }
 
+// Bytes of segment data in an image, for progress totals
+template<typename ElfPhdr>
+uint64_t segment_bytes(std::span<const ElfPhdr> phdrs, bool is_little_endian) {
+    uint64_t total = 0;
+    for (const auto& phdr : phdrs) {
+        total += from_file_endian(phdr.p_filesz, is_little_endian);
+    }
+    return total;
+}
+
+// Size of the block an image starts with: the ELF header, the program
+// headers and, for PN_XNUM images, section header 0
+template<typename ElfHeader, typename ElfPhdr>
+size_t header_block_size(const ElfHeader& ehdr, size_t phnum, bool is_little_endian) {
+    size_t size = std::max<size_t>(sizeof(ElfHeader),
+        from_file_endian(ehdr.e_phoff, is_little_endian) + phnum * sizeof(ElfPhdr));
+    if (from_file_endian(ehdr.e_phnum, is_little_endian) == PN_XNUM) {
+        size = std::max<size_t>(size, from_file_endian(ehdr.e_shoff, is_little_endian)
+                                      + sizeof(ElfShdr<ElfHeader>));
+    }
+    return size;
+}
+
+// The header block assembled from parsed headers, as squash writes it and
+// as the mdt starts. Bytes between the headers are zero.
+template<typename ElfHeader, typename ElfPhdr>
+auto header_block(std::istream& file, const ElfHeader& ehdr, std::span<const ElfPhdr> phdrs,
+                  bool is_little_endian) -> std::vector<uint8_t>
+{
+    std::vector<uint8_t> block(header_block_size<ElfHeader, ElfPhdr>(ehdr, phdrs.size(),
+                                                                     is_little_endian));
+    std::memcpy(block.data(), &ehdr, sizeof(ElfHeader));
+    if (auto shdr = read_xnum_section_header(file, ehdr, is_little_endian)) {
+        std::memcpy(block.data() + from_file_endian(ehdr.e_shoff, is_little_endian),
+                    &*shdr, sizeof(*shdr));
+    }
+    if (!phdrs.empty()) {
+        std::memcpy(block.data() + from_file_endian(ehdr.e_phoff, is_little_endian),
+                    phdrs.data(), phdrs.size_bytes());
+    }
+    return block;
+}
+
 template<typename ElfPhdr>
 struct PhdrInfo {
     decltype(ElfPhdr::p_offset) offset;
@@ -158,19 +286,64 @@ PhdrInfo<ElfPhdr> get_phdr_info(const ElfPhdr& phdr, bool is_little_endian) {
 
 // Common file writing helpers
 
+// The program header table is contiguous, so it goes out in one write
 inline void write_elf_header_and_phdrs(std::ofstream& out,
                                        std::span<const uint8_t> ehdr_bytes,
                                        size_t phoff,
-                                       std::span<const uint8_t> phdrs_bytes,
-                                       size_t phdr_size)
+                                       std::span<const uint8_t> phdrs_bytes)
 {
     write_file_at(out, 0, ehdr_bytes);
+    write_file_at(out, phoff, phdrs_bytes);
+}
+
+// A byte range of an image and the input it comes from
+struct ImagePiece {
+    uint64_t offset;
+    uint64_t size;
+    size_t source;          // squash: 0 for the headers, segment index + 1 otherwise
+    uint64_t source_offset;
+};
+
+// Lays pieces out the way squash_impl's writes land: a later piece replaces
+// whatever earlier pieces it overlaps. The result is disjoint and sorted.
+// Pieces are kept keyed by offset, so each write only visits the pieces it
+// overlaps and images with thousands of segments stay O(n log n).
+inline auto resolve_pieces(std::span<const ImagePiece> writes) -> std::vector<ImagePiece> {
+    std::map<uint64_t, ImagePiece> pieces;
+
+    for (const auto& p : writes) {
+        if (p.size == 0) continue;
+        uint64_t end = p.offset + p.size;
+
+        // The first piece that could overlap is the one before p's offset
+        auto it = pieces.lower_bound(p.offset);
+        if (it != pieces.begin() && std::prev(it)->second.offset + std::prev(it)->second.size > p.offset) {
+            --it;
+        }
+
+        while (it != pieces.end() && it->second.offset < end) {
+            auto q = it->second;
+            it = pieces.erase(it);
+            if (q.offset < p.offset) {
+                pieces.emplace(q.offset, ImagePiece{q.offset, p.offset - q.offset, q.source,
+                                                    q.source_offset});
+            }
+            if (q.offset + q.size > end) {
+                uint64_t cut = end - q.offset;
+                it = pieces.emplace(end, ImagePiece{end, q.size - cut, q.source,
+                                                    q.source_offset + cut}).first;
+                break;
+            }
+        }
+        pieces.emplace(p.offset, p);
+    }
 
-    size_t num_phdrs = phdrs_bytes.size() / phdr_size;
-    for (size_t i = 0; i < num_phdrs; ++i) {
-        write_file_at(out, phoff + i * phdr_size,
-                      phdrs_bytes.subspan(i * phdr_size, phdr_size));
+    std::vector<ImagePiece> sorted;
+    sorted.reserve(pieces.size());
+    for (const auto& [offset, piece] : pieces) {
+        sorted.push_back(piece);
     }
+    return sorted;
 }
 
 } // namespace pil
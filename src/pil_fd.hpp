@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_FD_HPP
+#define PIL_FD_HPP
+
+#include <cstddef>
+#include <cerrno>
+#include <utility>
+#include <filesystem>
+
+#include <fcntl.h>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PIL_HAVE_MMAP 1
+#endif
+
+#include "pil_common.hpp"
+
+namespace pil {
+
+// Raw file descriptors for the kernel fast paths. Everywhere else the tools
+// go through iostreams; these helpers report "unsupported" off Linux so the
+// callers can fall back to buffered copies.
+
+class UniqueFd {
+public:
+    UniqueFd() = default;
+    explicit UniqueFd(int fd) : fd_(fd) {}
+    UniqueFd(UniqueFd&& other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+    UniqueFd& operator=(UniqueFd&& other) noexcept {
+        reset(std::exchange(other.fd_, -1));
+        return *this;
+    }
+    ~UniqueFd() { reset(); }
+
+    int get() const noexcept { return fd_; }
+    explicit operator bool() const noexcept { return fd_ >= 0; }
+
+    void reset(int fd = -1) noexcept {
+#ifdef __linux__
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+#endif
+        fd_ = fd;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+// Opens a descriptor for the kernel fast paths; an empty UniqueFd means the
+// caller should stay on the iostream path
+inline UniqueFd open_fd(const std::filesystem::path& path, [[maybe_unused]] int flags) {
+#ifdef __linux__
+    ScopedIo timed(IoOp::open);
+    return UniqueFd(::open(path.c_str(), flags | O_CLOEXEC));
+#else
+    (void)path;
+    return UniqueFd();
+#endif
+}
+
+// Copies up to size bytes between two files inside the kernel. Returns the
+// number of bytes copied, which is short when the kernel or filesystem does
+// not support the copy; the caller finishes the rest with a buffered copy.
+inline size_t copy_file_range_at([[maybe_unused]] int in_fd, [[maybe_unused]] size_t in_offset,
+                                 [[maybe_unused]] int out_fd, [[maybe_unused]] size_t out_offset,
+                                 size_t size)
+{
+    size_t copied = 0;
+#ifdef __linux__
+    ScopedIo timed(IoOp::copy);
+    int saved_errno = errno;
+    loff_t in_off = static_cast<loff_t>(in_offset);
+    loff_t out_off = static_cast<loff_t>(out_offset);
+
+    while (copied < size) {
+        auto n = ::copy_file_range(in_fd, &in_off, out_fd, &out_off, size - copied, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        copied += static_cast<size_t>(n);
+    }
+    errno = saved_errno;
+    stats().count_copy(copied);
+#endif
+    return copied;
+}
+
+// Reads up to buffer.size() bytes at offset; short only at end of file
+inline size_t read_fd_at([[maybe_unused]] int fd, [[maybe_unused]] size_t offset,
+                         [[maybe_unused]] std::span<uint8_t> buffer)
+{
+    size_t done = 0;
+#if defined(__unix__) || defined(__APPLE__)
+    ScopedIo timed(IoOp::read);
+    while (done < buffer.size()) {
+        auto n = ::pread(fd, buffer.data() + done, buffer.size() - done,
+                         static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            throw_system_error("Failed to read");
+        }
+        if (n == 0) break;
+        done += static_cast<size_t>(n);
+    }
+    stats().count_read(done);
+#endif
+    return done;
+}
+
+// Read-only view of a whole file: a private mapping where mmap exists, the
+// file read into memory otherwise
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path& path) {
+#ifdef PIL_HAVE_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw_system_error(std::format("Failed to open {}", path.string()));
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw_system_error(std::format("Failed to stat {}", path.string()));
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED) {
+                throw_system_error(std::format("Failed to map {}", path.string()));
+            }
+            data_ = static_cast<const uint8_t*>(p);
+            mapped_ = true;
+            return;
+        }
+        ::close(fd);
+#endif
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw_system_error(std::format("Failed to open {}", path.string()));
+        }
+        in.exceptions(std::ios::failbit | std::ios::badbit);
+        in.seekg(0, std::ios::end);
+        size_ = static_cast<size_t>(in.tellg());
+        fallback_ = read_file_at(in, 0, size_);
+        data_ = fallback_.data();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifdef PIL_HAVE_MMAP
+        if (mapped_) {
+            ::munmap(const_cast<uint8_t*>(data_), size_);
+        }
+#endif
+    }
+
+    const uint8_t* data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    std::span<const uint8_t> bytes() const noexcept { return {data_, size_}; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<uint8_t> fallback_;
+};
+
+} // namespace pil
+
+#endif // PIL_FD_HPP
@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_GENFW_HPP
+#define PIL_GENFW_HPP
+
+#include <bit>
+#include <cmath>
+#include <random>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+
+#include "pil_common.hpp"
+#include "pil_sparse.hpp"
+
+namespace pil {
+
+// Synthetic firmware images with the shape of real PIL images: a header
+// segment covering the ELF and program headers, a hash segment, and load
+// segments of random size and content, page aligned with optional gaps,
+// containing runs of zero blocks. The same options and seed always give the
+// same image, on any platform: every random choice is made with integer
+// arithmetic on raw mt19937_64 output, whose sequence the standard fixes,
+// never through the <random> distributions or libm, which it does not.
+
+constexpr uint64_t GENFW_LOAD_ADDRESS = 0x80000000;
+
+struct GenOptions {
+    uint8_t elf_class = ELFCLASS32;
+    bool little_endian = true;
+    size_t segments = 8;                    // load segments with data
+    size_t empty_segments = 1;              // load segments without file data
+    uint64_t min_segment_size = 64 << 10;
+    uint64_t max_segment_size = 1 << 20;    // sizes are log-uniform in between
+    std::optional<size_t> hash_index = 1;   // phdr index of the hash segment
+    uint64_t gap = 0;                       // unused bytes before each segment
+    double zero_fraction = 0.25;            // share of 4 KiB blocks that are zero
+    uint64_t seed = 1;
+    bool xnum = false;                      // PN_XNUM even below 65535 phdrs
+};
+
+inline uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Uniform in [0, n), without modulo bias
+inline uint64_t random_below(std::mt19937_64& rng, uint64_t n) {
+    uint64_t threshold = (0 - n) % n;
+    while (true) {
+        uint64_t r = rng();
+        if (r >= threshold) return r % n;
+    }
+}
+
+// True with the given probability, to 2^-64
+inline bool random_chance(std::mt19937_64& rng, double probability) {
+    if (probability >= 1.0) return true;
+    // Scaling by a power of two and truncating are exact
+    return rng() < static_cast<uint64_t>(std::ldexp(probability, 64));
+}
+
+// Fisher-Yates, as std::shuffle would do with a portable index choice
+template<typename T>
+void random_shuffle(std::vector<T>& items, std::mt19937_64& rng) {
+    for (size_t i = items.size(); i > 1; --i) {
+        std::swap(items[i - 1], items[random_below(rng, i)]);
+    }
+}
+
+// log2 and exp2 in 16.16 fixed point, with 31-bit mantissas so that every
+// product fits 64 bits
+constexpr unsigned LOG_FRACTION_BITS = 16;
+
+inline uint64_t fixed_log2(uint64_t x) {
+    unsigned n = std::bit_width(x) - 1;
+    uint64_t m = n <= 31 ? x << (31 - n) : x >> (n - 31);   // [1, 2) in Q31
+    uint64_t result = uint64_t(n) << LOG_FRACTION_BITS;
+    for (unsigned bit = LOG_FRACTION_BITS; bit-- > 0;) {
+        m = (m * m) >> 31;
+        if (m >= (2ULL << 31)) {
+            m >>= 1;
+            result |= 1ULL << bit;
+        }
+    }
+    return result;
+}
+
+inline uint64_t fixed_exp2(uint64_t y) {
+    // 2^(2^-i) in Q31, for i = 1..16
+    static constexpr uint64_t ROOTS[LOG_FRACTION_BITS] = {
+        3037000500, 2553802834, 2341847524, 2242560872, 2194507417, 2170868212,
+        2159144272, 2153306067, 2150392887, 2148937775, 2148210589, 2147847087,
+        2147665360, 2147574502, 2147529075, 2147506361,
+    };
+    uint64_t k = y >> LOG_FRACTION_BITS;
+    if (k >= 63) return UINT64_MAX;
+
+    uint64_t m = 1ULL << 31;
+    for (unsigned i = 0; i < LOG_FRACTION_BITS; ++i) {
+        if (y & (1ULL << (LOG_FRACTION_BITS - 1 - i))) {
+            m = (m * ROOTS[i]) >> 31;
+        }
+    }
+    return k >= 31 ? m << (k - 31) : m >> (31 - k);
+}
+
+// Log-uniform in [min, max]
+inline uint64_t random_log_uniform(std::mt19937_64& rng, uint64_t min, uint64_t max) {
+    uint64_t lo = fixed_log2(min);
+    uint64_t hi = fixed_log2(max);
+    return std::clamp(fixed_exp2(lo + random_below(rng, hi - lo + 1)), min, max);
+}
+
+// Fills a segment with random data, interleaved with zero runs of up to
+// eight blocks
+inline void fill_segment(std::span<uint8_t> data, double zero_fraction, std::mt19937_64& rng) {
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t len = std::min((1 + random_below(rng, 8)) * SPARSE_BLOCK_SIZE, data.size() - pos);
+        if (random_chance(rng, zero_fraction)) {
+            std::fill_n(data.begin() + pos, len, 0);
+        } else {
+            for (size_t i = pos; i < pos + len; i += sizeof(uint64_t)) {
+                uint64_t word = rng();
+                std::memcpy(data.data() + i, &word, std::min(sizeof(word), pos + len - i));
+            }
+        }
+        pos += len;
+    }
+}
+
+template<typename ElfHeader, typename ElfPhdr>
+void generate_impl(std::ofstream& mbn, const GenOptions& options) {
+    using Addr = decltype(ElfPhdr::p_offset);
+    bool le = options.little_endian;
+    std::mt19937_64 rng(options.seed);
+
+    // Program header order: header segment, then load segments with the
+    // empty ones mixed in, with the hash segment spliced in at its index
+    enum class Kind { header, hash, load, empty };
+    std::vector<Kind> kinds(options.segments, Kind::load);
+    kinds.insert(kinds.end(), options.empty_segments, Kind::empty);
+    random_shuffle(kinds, rng);
+    kinds.insert(kinds.begin(), Kind::header);
+    if (options.hash_index) {
+        if (*options.hash_index == 0 || *options.hash_index > kinds.size()) {
+            throw Error(std::format("Hash segment index must be between 1 and {}", kinds.size()));
+        }
+        kinds.insert(kinds.begin() + *options.hash_index, Kind::hash);
+    }
+
+    // From PN_XNUM program headers on, e_phnum holds PN_XNUM and the count
+    // goes into sh_info of a lone section header after the program headers
+    bool xnum = options.xnum || kinds.size() >= PN_XNUM;
+    size_t phoff = sizeof(ElfHeader);
+    size_t shoff = phoff + kinds.size() * sizeof(ElfPhdr);
+    size_t headers_size = shoff + (xnum ? sizeof(ElfShdr<ElfHeader>) : 0);
+
+    ElfHeader ehdr{};
+    std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = options.elf_class;
+    ehdr.e_ident[EI_DATA] = le ? ELFDATA2LSB : ELFDATA2MSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = from_file_endian<uint16_t>(ET_EXEC, le);
+    ehdr.e_machine = from_file_endian<uint16_t>(options.elf_class == ELFCLASS64 ? EM_AARCH64
+                                                                              : EM_ARM, le);
+    ehdr.e_version = from_file_endian<uint32_t>(EV_CURRENT, le);
+    ehdr.e_entry = from_file_endian<Addr>(GENFW_LOAD_ADDRESS, le);
+    ehdr.e_phoff = from_file_endian<Addr>(phoff, le);
+    ehdr.e_ehsize = from_file_endian<uint16_t>(sizeof(ElfHeader), le);
+    ehdr.e_phentsize = from_file_endian<uint16_t>(sizeof(ElfPhdr), le);
+    ehdr.e_phnum = from_file_endian<uint16_t>(xnum ? PN_XNUM : kinds.size(), le);
+
+    ElfShdr<ElfHeader> shdr{};
+    if (xnum) {
+        ehdr.e_shoff = from_file_endian<Addr>(shoff, le);
+        ehdr.e_shentsize = from_file_endian<uint16_t>(sizeof(shdr), le);
+        ehdr.e_shnum = from_file_endian<uint16_t>(1, le);
+        shdr.sh_info = from_file_endian<uint32_t>(kinds.size(), le);
+    }
+
+    std::vector<ElfPhdr> phdrs(kinds.size());
+    std::vector<uint8_t> data;
+    uint64_t offset = headers_size;
+    uint64_t bss = 0;   // address space taken by memsz beyond filesz so far
+
+    for (size_t i = 0; i < kinds.size(); ++i) {
+        uint64_t filesz = 0, memsz = 0;
+        uint32_t type = PT_LOAD, flags = PF_R;
+
+        switch (kinds[i]) {
+        case Kind::header:
+            type = PT_NULL;
+            filesz = headers_size;
+            flags = PIL_SEGMENT_TYPE_PHDR << PIL_SEGMENT_TYPE_SHIFT;
+            break;
+        case Kind::hash:
+            // Room for a digest per segment plus a signature and certificates
+            type = PT_NULL;
+            filesz = 40 + 32 * kinds.size() + 256 + 3 * 1024;
+            flags = PIL_SEGMENT_TYPE_HASH << PIL_SEGMENT_TYPE_SHIFT;
+            break;
+        case Kind::load:
+            filesz = random_log_uniform(rng, options.min_segment_size, options.max_segment_size);
+            flags = PF_R | (rng() % 2 ? PF_X : PF_W);
+            break;
+        case Kind::empty:
+            memsz = align_up(random_log_uniform(rng, options.min_segment_size, options.max_segment_size),
+                             SPARSE_BLOCK_SIZE);
+            flags = PF_R | PF_W;
+            break;
+        }
+        memsz = std::max(memsz, filesz);
+
+        uint64_t p_offset = 0;
+        if (kinds[i] != Kind::header) {
+            p_offset = align_up(offset + options.gap, SPARSE_BLOCK_SIZE);
+            offset = p_offset + filesz;
+        }
+
+        if (kinds[i] == Kind::hash || kinds[i] == Kind::load) {
+            data.resize(filesz);
+            fill_segment(data, kinds[i] == Kind::hash ? 0.0 : options.zero_fraction, rng);
+            write_file_at(mbn, p_offset, data);
+        }
+
+        auto& phdr = phdrs[i];
+        uint64_t vaddr = kinds[i] == Kind::header ? 0 : GENFW_LOAD_ADDRESS + p_offset + bss;
+        bss += align_up(memsz - filesz, SPARSE_BLOCK_SIZE);
+        phdr.p_type = from_file_endian<uint32_t>(type, le);
+        phdr.p_flags = from_file_endian<uint32_t>(flags, le);
+        phdr.p_offset = from_file_endian<Addr>(p_offset, le);
+        phdr.p_vaddr = from_file_endian<Addr>(vaddr, le);
+        phdr.p_paddr = from_file_endian<Addr>(vaddr, le);
+        phdr.p_filesz = from_file_endian<Addr>(filesz, le);
+        phdr.p_memsz = from_file_endian<Addr>(memsz, le);
+        phdr.p_align = from_file_endian<Addr>(kinds[i] == Kind::header ? 0 : SPARSE_BLOCK_SIZE, le);
+    }
+
+    write_elf_header_and_phdrs(mbn,
+        std::span{reinterpret_cast<const uint8_t*>(&ehdr), sizeof(ehdr)},
+        phoff,
+        std::span{reinterpret_cast<const uint8_t*>(phdrs.data()), phdrs.size() * sizeof(ElfPhdr)});
+    if (xnum) {
+        write_file_at(mbn, shoff, std::span{reinterpret_cast<const uint8_t*>(&shdr), sizeof(shdr)});
+    }
+}
+
+inline void generate(const std::filesystem::path& mbn_path, const GenOptions& options) {
+    if (options.min_segment_size == 0 || options.min_segment_size > options.max_segment_size) {
+        throw Error("Invalid segment size range");
+    }
+    if (!(options.zero_fraction >= 0.0 && options.zero_fraction <= 1.0)) {
+        throw Error("Zero fraction must be between 0 and 1");
+    }
+
+    std::ofstream mbn(mbn_path, std::ios::binary | std::ios::trunc);
+    if (!mbn) {
+        throw_system_error(std::format("Failed to create {}", mbn_path.string()));
+    }
+    mbn.exceptions(std::ios::failbit | std::ios::badbit);
+
+    if (options.elf_class == ELFCLASS64) {
+        generate_impl<Elf64_Ehdr, Elf64_Phdr>(mbn, options);
+    } else {
+        generate_impl<Elf32_Ehdr, Elf32_Phdr>(mbn, options);
+    }
+}
+
+} // namespace pil
+
+#endif // PIL_GENFW_HPP
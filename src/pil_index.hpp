@@ -0,0 +1,387 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_INDEX_HPP
+#define PIL_INDEX_HPP
+
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <filesystem>
+
+#include "pil_common.hpp"
+#include "pil_sha256.hpp"
+#include "pil_fd.hpp"
+
+namespace pil {
+
+// Layout index: segment layouts and digests of one or more images, laid out
+// so a merged index of a whole tree can be queried straight from a mapping.
+//
+//   IndexHeader | ImageRecord[image_count] | SegmentRecord[segment_count]
+//   | uint32_t digest_order[segment_count] | string table
+//
+// All fields are little-endian. digest_order lists segment numbers sorted by
+// digest so lookups are a binary search.
+
+constexpr std::array<uint8_t, 8> PIL_INDEX_MAGIC = {'P', 'I', 'L', 'I', 'D', 'X', 0, 1};
+constexpr const char* PIL_INDEX_EXTENSION = ".pilidx";
+constexpr uint32_t PIL_INDEX_NO_HASH_SEGMENT = UINT32_MAX;
+
+struct IndexHeader {
+    std::array<uint8_t, 8> magic;
+    uint32_t image_count;
+    uint32_t segment_count;
+    uint32_t strings_size;
+    uint32_t reserved[3];
+};
+
+struct ImageRecord {
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint32_t first_segment;
+    uint32_t segment_count;
+    uint64_t image_size;
+    uint32_t hash_segment;      // index within the image, or PIL_INDEX_NO_HASH_SEGMENT
+    uint8_t elf_class;
+    uint8_t is_little_endian;
+    uint16_t reserved;
+};
+
+struct SegmentRecord {
+    uint64_t offset;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint32_t flags;
+    uint32_t image;
+    Sha256::Digest digest;
+};
+
+static_assert(sizeof(IndexHeader) == 32);
+static_assert(sizeof(ImageRecord) == 32);
+static_assert(sizeof(SegmentRecord) == 64);
+
+// Host-order view of an index, used to build and merge sidecars
+struct LayoutIndex {
+    struct Image {
+        std::string name;
+        uint64_t image_size = 0;
+        uint32_t hash_segment = PIL_INDEX_NO_HASH_SEGMENT;
+        uint8_t elf_class = 0;
+        bool is_little_endian = true;
+        std::vector<SegmentRecord> segments;    // image field unused here
+    };
+
+    std::vector<Image> images;
+};
+
+template<typename ElfHeader, typename ElfPhdr>
+auto index_image_impl(std::istream& mbn, bool is_little_endian) -> LayoutIndex::Image {
+    auto ehdr = read_elf_header<ElfHeader>(mbn);
+    auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(mbn, ehdr, is_little_endian);
+
+    LayoutIndex::Image image;
+    image.elf_class = sizeof(ElfHeader) == sizeof(Elf64_Ehdr) ? ELFCLASS64 : ELFCLASS32;
+    image.is_little_endian = is_little_endian;
+    image.image_size = header_block_size<ElfHeader, ElfPhdr>(ehdr, phdrs.size(), is_little_endian);
+
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
+
+        SegmentRecord segment{};
+        segment.offset = p_offset;
+        segment.filesz = p_filesz;
+        segment.memsz = from_file_endian(phdrs[i].p_memsz, is_little_endian);
+        segment.flags = p_flags;
+
+        // Hash in bounded chunks so large segments are never held whole
+        Sha256 sha;
+        for (size_t done = 0; done < p_filesz; ) {
+            size_t chunk = std::min<size_t>(p_filesz - done, 1 << 20);
+            sha.update(read_file_at(mbn, p_offset + done, chunk));
+            done += chunk;
+        }
+        segment.digest = sha.finish();
+
+        if (is_pil_hash_segment(p_flags) && image.hash_segment == PIL_INDEX_NO_HASH_SEGMENT) {
+            image.hash_segment = static_cast<uint32_t>(i);
+        }
+        image.image_size = std::max<uint64_t>(image.image_size, p_offset + p_filesz);
+        image.segments.push_back(segment);
+    }
+
+    return image;
+}
+
+// Indexes an mbn image, hashing each segment's file bytes
+inline auto index_image(std::istream& mbn, std::string name) -> LayoutIndex::Image {
+    auto format = detect_elf_format(mbn);
+
+    auto image = format.elf_class == ELFCLASS32
+        ? index_image_impl<Elf32_Ehdr, Elf32_Phdr>(mbn, format.is_little_endian)
+        : index_image_impl<Elf64_Ehdr, Elf64_Phdr>(mbn, format.is_little_endian);
+    image.name = std::move(name);
+    return image;
+}
+
+inline auto serialize_index(const LayoutIndex& index) -> std::vector<uint8_t> {
+    std::vector<uint8_t> out;
+    std::string strings;
+    uint32_t segment_count = 0;
+    for (const auto& image : index.images) {
+        segment_count += static_cast<uint32_t>(image.segments.size());
+    }
+
+    out.insert(out.end(), PIL_INDEX_MAGIC.begin(), PIL_INDEX_MAGIC.end());
+    append_le<uint32_t>(out, static_cast<uint32_t>(index.images.size()));
+    append_le<uint32_t>(out, segment_count);
+    size_t strings_size_at = out.size();
+    out.resize(sizeof(IndexHeader));
+
+    uint32_t first_segment = 0;
+    for (const auto& image : index.images) {
+        append_le<uint32_t>(out, static_cast<uint32_t>(strings.size()));
+        append_le<uint32_t>(out, static_cast<uint32_t>(image.name.size()));
+        append_le<uint32_t>(out, first_segment);
+        append_le<uint32_t>(out, static_cast<uint32_t>(image.segments.size()));
+        append_le<uint64_t>(out, image.image_size);
+        append_le<uint32_t>(out, image.hash_segment);
+        out.push_back(image.elf_class);
+        out.push_back(image.is_little_endian ? 1 : 0);
+        append_le<uint16_t>(out, 0);
+
+        strings += image.name;
+        first_segment += static_cast<uint32_t>(image.segments.size());
+    }
+
+    std::vector<std::pair<const Sha256::Digest*, uint32_t>> order;
+    uint32_t image_number = 0;
+    for (const auto& image : index.images) {
+        for (const auto& segment : image.segments) {
+            order.emplace_back(&segment.digest, static_cast<uint32_t>(order.size()));
+            append_le<uint64_t>(out, segment.offset);
+            append_le<uint64_t>(out, segment.filesz);
+            append_le<uint64_t>(out, segment.memsz);
+            append_le<uint32_t>(out, segment.flags);
+            append_le<uint32_t>(out, image_number);
+            out.insert(out.end(), segment.digest.begin(), segment.digest.end());
+        }
+        ++image_number;
+    }
+
+    std::ranges::stable_sort(order, [](const auto& a, const auto& b) { return *a.first < *b.first; });
+    for (const auto& entry : order) {
+        append_le<uint32_t>(out, entry.second);
+    }
+
+    auto strings_size = from_file_endian(static_cast<uint32_t>(strings.size()), true);
+    std::memcpy(out.data() + strings_size_at, &strings_size, sizeof(strings_size));
+    out.insert(out.end(), strings.begin(), strings.end());
+    return out;
+}
+
+inline void write_index_file(const std::filesystem::path& path, const LayoutIndex& index) {
+    auto data = serialize_index(index);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw_system_error(std::format("Failed to create {}", path.string()));
+    }
+    out.exceptions(std::ios::failbit | std::ios::badbit);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+// Indexes the mbn at mbn_path into a single-image sidecar. This is a second
+// pass that reads and hashes the whole mbn after it is written, so --index
+// costs one extra read of the image. That is deliberate: the digests must
+// describe the bytes that ended up in the file, and the copy loop does not
+// see those when segments overlap, when copy_file_range moves the data in
+// the kernel, or when a cache hit reflinks the result.
+inline void write_index_sidecar(const std::filesystem::path& mbn_path,
+                                const std::filesystem::path& sidecar_path,
+                                std::string name)
+{
+    std::ifstream mbn(mbn_path, std::ios::binary);
+    if (!mbn) {
+        throw_system_error(std::format("Failed to open {}", mbn_path.string()));
+    }
+    mbn.exceptions(std::ios::failbit | std::ios::badbit);
+
+    LayoutIndex index;
+    index.images.push_back(index_image(mbn, std::move(name)));
+    write_index_file(sidecar_path, index);
+}
+
+// Read-only mapping of an index file. Records are decoded on access, so the
+// index is never parsed up front.
+class MappedIndex {
+public:
+    struct Image {
+        std::string_view name;
+        uint32_t first_segment;
+        uint32_t segment_count;
+        uint64_t image_size;
+        uint32_t hash_segment;
+        uint8_t elf_class;
+        bool is_little_endian;
+    };
+
+    struct Segment {
+        uint64_t offset;
+        uint64_t filesz;
+        uint64_t memsz;
+        uint32_t flags;
+        uint32_t image;
+        std::span<const uint8_t, 32> digest;
+    };
+
+    explicit MappedIndex(const std::filesystem::path& path)
+        : path_(path), file_(path), data_(file_.data()), size_(file_.size())
+    {
+        if (size_ < sizeof(IndexHeader) ||
+            std::memcmp(data_, PIL_INDEX_MAGIC.data(), PIL_INDEX_MAGIC.size()) != 0) {
+            throw Error(std::format("{} is not a layout index", path.string()));
+        }
+
+        image_count_ = load_le<uint32_t>(data_ + 8);
+        segment_count_ = load_le<uint32_t>(data_ + 12);
+        auto strings_size = load_le<uint32_t>(data_ + 16);
+
+        uint64_t segments_at = sizeof(IndexHeader) + uint64_t(image_count_) * sizeof(ImageRecord);
+        uint64_t order_at = segments_at + uint64_t(segment_count_) * sizeof(SegmentRecord);
+        uint64_t strings_at = order_at + uint64_t(segment_count_) * sizeof(uint32_t);
+
+        if (strings_at + strings_size > size_) {
+            throw Error(std::format("{} is truncated", path.string()));
+        }
+
+        images_ = data_ + sizeof(IndexHeader);
+        segments_ = data_ + segments_at;
+        order_ = data_ + order_at;
+        strings_ = data_ + strings_at;
+        strings_size_ = strings_size;
+    }
+
+    uint32_t image_count() const { return image_count_; }
+    uint32_t segment_count() const { return segment_count_; }
+
+    // Record numbers, and the image numbers stored in segment records, are
+    // checked on access, so a corrupt index throws instead of reading past
+    // the mapping
+    Image image(uint32_t i) const {
+        if (i >= image_count_) {
+            throw Error(std::format("{}: image {} out of range", path_.string(), i));
+        }
+        const uint8_t* r = images_ + size_t(i) * sizeof(ImageRecord);
+        auto name_offset = load_le<uint32_t>(r);
+        auto name_size = load_le<uint32_t>(r + 4);
+        auto first_segment = load_le<uint32_t>(r + 8);
+        auto segment_count = load_le<uint32_t>(r + 12);
+        if (uint64_t(name_offset) + name_size > strings_size_ ||
+            uint64_t(first_segment) + segment_count > segment_count_) {
+            throw Error(std::format("{}: image record {} out of range", path_.string(), i));
+        }
+        return Image{
+            std::string_view(reinterpret_cast<const char*>(strings_) + name_offset, name_size),
+            first_segment,
+            segment_count,
+            load_le<uint64_t>(r + 16),
+            load_le<uint32_t>(r + 24),
+            r[28],
+            r[29] != 0,
+        };
+    }
+
+    Segment segment(uint32_t i) const {
+        if (i >= segment_count_) {
+            throw Error(std::format("{}: segment {} out of range", path_.string(), i));
+        }
+        const uint8_t* r = segments_ + size_t(i) * sizeof(SegmentRecord);
+        auto image = load_le<uint32_t>(r + 28);
+        if (image >= image_count_) {
+            throw Error(std::format("{}: segment record {} out of range", path_.string(), i));
+        }
+        return Segment{
+            load_le<uint64_t>(r),
+            load_le<uint64_t>(r + 8),
+            load_le<uint64_t>(r + 16),
+            load_le<uint32_t>(r + 24),
+            image,
+            std::span<const uint8_t, 32>(r + 32, 32),
+        };
+    }
+
+    // Segment numbers whose digest equals the given one
+    auto find_digest(std::span<const uint8_t, 32> digest) const -> std::vector<uint32_t> {
+        auto digest_of = [&](uint32_t n) {
+            auto seg = load_le<uint32_t>(order_ + size_t(n) * sizeof(uint32_t));
+            if (seg >= segment_count_) {
+                throw Error(std::format("{}: digest order entry out of range", path_.string()));
+            }
+            return std::pair{seg, segments_ + size_t(seg) * sizeof(SegmentRecord) + 32};
+        };
+
+        uint32_t lo = 0, hi = segment_count_;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (std::memcmp(digest_of(mid).second, digest.data(), 32) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        std::vector<uint32_t> matches;
+        for (; lo < segment_count_; ++lo) {
+            auto [seg, d] = digest_of(lo);
+            if (std::memcmp(d, digest.data(), 32) != 0) break;
+            matches.push_back(seg);
+        }
+        return matches;
+    }
+
+    // Copies the index back into host order, e.g. for merging
+    auto load() const -> LayoutIndex {
+        LayoutIndex index;
+        for (uint32_t i = 0; i < image_count_; ++i) {
+            auto img = image(i);
+            LayoutIndex::Image out;
+            out.name = img.name;
+            out.image_size = img.image_size;
+            out.hash_segment = img.hash_segment;
+            out.elf_class = img.elf_class;
+            out.is_little_endian = img.is_little_endian;
+            for (uint32_t s = 0; s < img.segment_count; ++s) {
+                auto seg = segment(img.first_segment + s);
+                SegmentRecord rec{};
+                rec.offset = seg.offset;
+                rec.filesz = seg.filesz;
+                rec.memsz = seg.memsz;
+                rec.flags = seg.flags;
+                std::ranges::copy(seg.digest, rec.digest.begin());
+                out.segments.push_back(rec);
+            }
+            index.images.push_back(std::move(out));
+        }
+        return index;
+    }
+
+private:
+    std::filesystem::path path_;
+    MappedFile file_;
+    const uint8_t* data_;
+    size_t size_;
+
+    uint32_t image_count_ = 0;
+    uint32_t segment_count_ = 0;
+    uint32_t strings_size_ = 0;
+    const uint8_t* images_ = nullptr;
+    const uint8_t* segments_ = nullptr;
+    const uint8_t* order_ = nullptr;
+    const uint8_t* strings_ = nullptr;
+};
+
+} // namespace pil
+
+#endif // PIL_INDEX_HPP
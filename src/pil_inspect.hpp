@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_INSPECT_HPP
+#define PIL_INSPECT_HPP
+
+#include <string>
+#include <tuple>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+
+#include "pil_common.hpp"
+
+namespace pil {
+
+// Structural inspection of mbn and mdt images from their headers alone.
+// Nothing past the ELF header, the program header table and (for PN_XNUM)
+// section header 0 is read, so checking an image costs a couple of small
+// reads however large it is.
+
+struct InspectedSegment {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t filesz;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t memsz;
+    uint64_t align;
+};
+
+// File ranges [begin, end) the headers occupy
+struct HeaderRange {
+    const char* name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+struct InspectedImage {
+    uint8_t elf_class = 0;
+    bool is_little_endian = true;
+    bool xnum = false;
+    uint64_t file_size = 0;
+    uint64_t header_size = 0;   // the header block squash writes and the mdt starts with
+    std::vector<HeaderRange> headers;
+    std::vector<InspectedSegment> segments;
+};
+
+template<typename ElfHeader, typename ElfPhdr>
+auto inspect_image_impl(std::istream& file, bool le) -> InspectedImage {
+    auto ehdr = read_elf_header<ElfHeader>(file);
+    auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(file, ehdr, le);
+
+    InspectedImage image;
+    image.elf_class = sizeof(ElfHeader) == sizeof(Elf64_Ehdr) ? ELFCLASS64 : ELFCLASS32;
+    image.is_little_endian = le;
+    image.xnum = from_file_endian(ehdr.e_phnum, le) == PN_XNUM;
+    file.seekg(0, std::ios::end);
+    image.file_size = static_cast<uint64_t>(file.tellg());
+    image.header_size = header_block_size<ElfHeader, ElfPhdr>(ehdr, phdrs.size(), le);
+
+    image.headers.push_back({"ELF header", 0, sizeof(ElfHeader)});
+    if (!phdrs.empty()) {
+        uint64_t phoff = from_file_endian(ehdr.e_phoff, le);
+        image.headers.push_back({"program header table", phoff, phoff + phdrs.size() * sizeof(ElfPhdr)});
+    }
+    if (image.xnum) {
+        uint64_t shoff = from_file_endian(ehdr.e_shoff, le);
+        image.headers.push_back({"section header 0", shoff, shoff + sizeof(ElfShdr<ElfHeader>)});
+    }
+
+    image.segments.reserve(phdrs.size());
+    for (const auto& phdr : phdrs) {
+        image.segments.push_back({
+            from_file_endian(phdr.p_type, le),
+            from_file_endian(phdr.p_flags, le),
+            from_file_endian(phdr.p_offset, le),
+            from_file_endian(phdr.p_filesz, le),
+            from_file_endian(phdr.p_vaddr, le),
+            from_file_endian(phdr.p_paddr, le),
+            from_file_endian(phdr.p_memsz, le),
+            from_file_endian(phdr.p_align, le),
+        });
+    }
+    return image;
+}
+
+inline auto inspect_image(std::istream& file) -> InspectedImage {
+    auto format = detect_elf_format(file);
+    if (format.elf_class == ELFCLASS64) {
+        return inspect_image_impl<Elf64_Ehdr, Elf64_Phdr>(file, format.is_little_endian);
+    }
+    return inspect_image_impl<Elf32_Ehdr, Elf32_Phdr>(file, format.is_little_endian);
+}
+
+// The header segment legitimately holds the headers as its data
+inline bool is_header_segment(const InspectedSegment& segment) {
+    return segment.type == PT_PHDR || pil_segment_type(segment.flags) == PIL_SEGMENT_TYPE_PHDR;
+}
+
+// Offset of each hash segment within the mdt, where squash expects it: in
+// phdr order, right after the bytes segment 0 covers
+inline auto mdt_hash_offsets(const InspectedImage& image) -> std::vector<std::pair<size_t, uint64_t>> {
+    std::vector<std::pair<size_t, uint64_t>> offsets;
+    uint64_t offset = image.segments.empty() ? 0 : image.segments[0].filesz;
+    for (size_t i = 0; i < image.segments.size(); ++i) {
+        const auto& s = image.segments[i];
+        if (s.filesz != 0 && is_pil_hash_segment(s.flags)) {
+            offsets.emplace_back(i, offset);
+            offset += s.filesz;
+        }
+    }
+    return offsets;
+}
+
+// Structural problems of an image, empty if there are none. With an mdt the
+// segment offsets still describe the mbn; what the mdt itself must hold is
+// the header block and the hash segments, and the bXX files next to it are
+// checked by size only.
+inline auto validate_image(const InspectedImage& image, const std::filesystem::path& path)
+    -> std::vector<std::string>
+{
+    std::vector<std::string> issues;
+    bool is_mdt = path.extension() == ".mdt";
+    const auto& segments = image.segments;
+
+    auto end_of = [](const InspectedSegment& s) { return s.offset + s.filesz; };
+
+    // Segments with file data, by offset; a sweep keeps the one reaching
+    // furthest so far, and anything starting before its end overlaps it
+    std::vector<size_t> order;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const auto& s = segments[i];
+        if (s.filesz == 0) continue;
+        if (s.offset > UINT64_MAX - s.filesz) {
+            issues.push_back(std::format("segment {} range overflows: offset {:#x} + {:#x} bytes",
+                                         i, s.offset, s.filesz));
+            continue;
+        }
+        order.push_back(i);
+    }
+    std::ranges::sort(order, [&](size_t a, size_t b) {
+        return std::tie(segments[a].offset, a) < std::tie(segments[b].offset, b);
+    });
+
+    std::optional<size_t> reach;
+    for (auto i : order) {
+        const auto& s = segments[i];
+        if (reach && s.offset < end_of(segments[*reach])) {
+            issues.push_back(std::format("segments {} and {} overlap at [{:#x}, {:#x})", *reach, i,
+                                         s.offset, std::min(end_of(s), end_of(segments[*reach]))));
+        }
+        if (!reach || end_of(s) > end_of(segments[*reach])) {
+            reach = i;
+        }
+
+        if (!is_mdt && end_of(s) > image.file_size) {
+            issues.push_back(std::format("segment {} ends at {:#x}, beyond the end of the file at {:#x}",
+                                         i, end_of(s), image.file_size));
+        }
+
+        if (!is_header_segment(s)) {
+            for (const auto& h : image.headers) {
+                if (s.offset < h.end && h.begin < end_of(s)) {
+                    issues.push_back(std::format("segment {} [{:#x}, {:#x}) overlaps the {} [{:#x}, {:#x})",
+                                                 i, s.offset, end_of(s), h.name, h.begin, h.end));
+                }
+            }
+        }
+    }
+
+    auto hashes = mdt_hash_offsets(image);
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (is_pil_hash_segment(segments[i].flags) && segments[i].filesz == 0) {
+            issues.push_back(std::format("hash segment {} is empty", i));
+        }
+    }
+    if (!hashes.empty()) {
+        if (hashes.front().first == 0) {
+            issues.push_back("hash segment is segment 0, where the header segment belongs");
+        } else if (segments[0].filesz != image.header_size) {
+            issues.push_back(std::format("segment 0 covers {:#x} bytes but the headers take {:#x}, "
+                                         "so the hash segment is misplaced in the mdt",
+                                         segments[0].filesz, image.header_size));
+        }
+    }
+
+    if (is_mdt) {
+        uint64_t needed = image.header_size;
+        for (auto [i, offset] : hashes) {
+            needed = std::max(needed, offset + segments[i].filesz);
+        }
+        if (needed > image.file_size) {
+            issues.push_back(std::format("mdt is {:#x} bytes, its headers and hash segments need {:#x}",
+                                         image.file_size, needed));
+        }
+
+        for (size_t i = 0; i < segments.size(); ++i) {
+            const auto& s = segments[i];
+            if (s.filesz == 0 || is_pil_hash_segment(s.flags)) continue;
+
+            auto bxx = segment_path(path, i);
+            std::error_code ec;
+            auto size = std::filesystem::file_size(bxx, ec);
+            if (ec) {
+                issues.push_back(std::format("{} is missing", bxx.filename().string()));
+            } else if (size < s.filesz) {
+                issues.push_back(std::format("{} is {:#x} bytes, segment {} needs {:#x}",
+                                             bxx.filename().string(), size, i, s.filesz));
+            }
+        }
+    }
+
+    return issues;
+}
+
+} // namespace pil
+
+#endif // PIL_INSPECT_HPP
@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_MEMFD_HPP
+#define PIL_MEMFD_HPP
+
+#include <string>
+#include <vector>
+#include <filesystem>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "pil_socket.hpp"
+#endif
+
+#include "pil_common.hpp"
+#include "pil_fd.hpp"
+#include "pil_squash.hpp"
+#include "pil_split.hpp"
+
+namespace pil {
+
+// Output into anonymous memory files (memfd_create), sealed against any
+// further change once complete. A consumer gets the descriptors either over
+// a Unix socket or by inheriting them, and can mmap them directly; nothing
+// touches a filesystem.
+//
+// Socket handoff: one "memfd\t<name>\t<size>" line per file, each carrying
+// its descriptor, followed by "end". Inherited descriptors are listed in the
+// PIL_MEMFDS environment variable as space-separated <name>=<fd> pairs.
+
+struct MemfdFile {
+    std::string name;
+    UniqueFd fd;
+    uint64_t size;
+};
+
+#ifdef __linux__
+
+inline UniqueFd create_memfd(const std::string& name) {
+    UniqueFd fd(::memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (!fd) {
+        throw_system_error(std::format("Failed to create memfd {}", name));
+    }
+    return fd;
+}
+
+// Freezes the contents and size for good; returns the final size
+inline uint64_t seal_memfd(int fd) {
+    if (::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        throw_system_error("Failed to seal memfd");
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        throw_system_error("Failed to stat memfd");
+    }
+    return static_cast<uint64_t>(st.st_size);
+}
+
+// The memfds are written through /dev/fd, so the regular path-based writers
+// apply unchanged. Features that need a real directory are refused.
+inline auto squash_to_memfd(const fs::path& mdt_path, const std::string& name,
+                            const SquashOptions& options) -> MemfdFile
+{
+    if (options.index || !options.cache_dir.empty()) {
+        throw Error("memfd output cannot be combined with --index or --cache");
+    }
+
+    auto fd = create_memfd(name);
+    squash(mdt_path, fd_path(fd.get()), options);
+    auto size = seal_memfd(fd.get());
+    return {name, std::move(fd), size};
+}
+
+// Writes each file of the set into its own memfd. Zero blocks are always
+// left as holes, since that saves memory and costs nothing on a new memfd.
+class MemfdSetWriter {
+public:
+    explicit MemfdSetWriter(const fs::path& mdt_name) : mdt_name_(mdt_name) {}
+
+    void write_mdt(std::span<const uint8_t> data) {
+        add(mdt_name_.string(), data);
+    }
+
+    void write_segment(size_t segment_index, std::span<const uint8_t> data) {
+        add(segment_path(mdt_name_, segment_index).string(), data);
+    }
+
+    auto files() -> std::vector<MemfdFile>& { return files_; }
+
+private:
+    void add(const std::string& name, std::span<const uint8_t> data) {
+        auto fd = create_memfd(name);
+        write_whole_file(fd_path(fd.get()), data, true);
+        auto size = seal_memfd(fd.get());
+        files_.push_back({name, std::move(fd), size});
+    }
+
+    fs::path mdt_name_;
+    std::vector<MemfdFile> files_;
+};
+
+inline auto split_to_memfds(const fs::path& mbn_path, const fs::path& mdt_name,
+                            const SplitOptions& options) -> std::vector<MemfdFile>
+{
+    if (options.index) {
+        throw Error("memfd output cannot be combined with --index");
+    }
+
+    CountedImage image;
+    auto mbn = open_mbn(mbn_path, mdt_name);
+    MemfdSetWriter writer(mdt_name.filename());
+    split_with(mbn, open_hole_fd(mbn_path, options), writer);
+    return std::move(writer.files());
+}
+
+inline void send_memfds(const fs::path& socket_path, const std::vector<MemfdFile>& files) {
+    auto sock = connect_unix(socket_path);
+    for (const auto& file : files) {
+        int fds[] = {file.fd.get()};
+        send_message(sock.get(), std::format("memfd\t{}\t{}\n", file.name, file.size), fds);
+    }
+    send_message(sock.get(), "end\n");
+}
+
+// Runs command through the shell with the memfds inherited; returns its
+// exit status
+inline int exec_with_memfds(const std::string& command, const std::vector<MemfdFile>& files) {
+    std::string list;
+    for (const auto& file : files) {
+        list += std::format("{}{}={}", list.empty() ? "" : " ", file.name, file.fd.get());
+    }
+    ::setenv("PIL_MEMFDS", list.c_str(), 1);
+
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        throw_system_error("Failed to fork");
+    }
+    if (pid == 0) {
+        for (const auto& file : files) {
+            ::fcntl(file.fd.get(), F_SETFD, 0);
+        }
+        ::execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char*>(nullptr));
+        ::_exit(127);
+    }
+
+    int status;
+    while (::waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            throw_system_error("Failed to wait for consumer");
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+#else
+
+inline auto squash_to_memfd(const fs::path&, const std::string&, const SquashOptions&)
+    -> MemfdFile
+{
+    throw Error("memfd output is only available on Linux");
+}
+
+inline auto split_to_memfds(const fs::path&, const fs::path&, const SplitOptions&)
+    -> std::vector<MemfdFile>
+{
+    throw Error("memfd output is only available on Linux");
+}
+
+inline void send_memfds(const fs::path&, const std::vector<MemfdFile>&) {}
+
+inline int exec_with_memfds(const std::string&, const std::vector<MemfdFile>&) {
+    return 1;
+}
+
+#endif
+
+// Hands finished memfds to their consumer: over socket_path if given,
+// otherwise to command as inherited descriptors. Returns the exit status
+// for the tool.
+inline int hand_off_memfds(const std::vector<MemfdFile>& files, const fs::path& socket_path,
+                           const std::string& command)
+{
+    if (!socket_path.empty()) {
+        send_memfds(socket_path, files);
+        return 0;
+    }
+    return exec_with_memfds(command, files);
+}
+
+} // namespace pil
+
+#endif // PIL_MEMFD_HPP
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_METRICS_HPP
+#define PIL_METRICS_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <stop_token>
+#include <system_error>
+#include <thread>
+
+#include "pil_stats.hpp"
+
+namespace pil {
+
+// --metrics <file>: the stats counters as a Prometheus textfile for
+// node_exporter. The file is written next to its final name and renamed over
+// it, so the collector never reads half of one. Long-running modes rewrite it every interval;
+// every mode writes it once more when done, failed runs included.
+class MetricsFile {
+public:
+    explicit MetricsFile(std::filesystem::path path,
+                         std::chrono::seconds interval = std::chrono::seconds::zero())
+        : path_(std::move(path))
+    {
+        stats().enable();
+        if (interval > interval.zero()) {
+            thread_ = std::jthread([this, interval](std::stop_token stop) { run(stop, interval); });
+        }
+    }
+
+    MetricsFile(const MetricsFile&) = delete;
+    MetricsFile& operator=(const MetricsFile&) = delete;
+
+    // A run that ends in an error still leaves its counts behind
+    ~MetricsFile() {
+        if (!closed_) {
+            try {
+                close();
+            } catch (...) {
+            }
+        }
+    }
+
+    // Stops the periodic writes and writes the final counts
+    void close() {
+        closed_ = true;
+        if (thread_.joinable()) {
+            thread_.request_stop();
+            thread_.join();
+        }
+        write();
+    }
+
+private:
+    void run(std::stop_token stop, std::chrono::seconds interval) {
+        std::mutex mutex;
+        std::condition_variable_any wake;
+        std::unique_lock lock(mutex);
+        while (true) {
+            wake.wait_for(lock, stop, interval, [] { return false; });
+            if (stop.stop_requested()) return;
+            try {
+                write();
+            } catch (...) {
+                // The next interval tries again
+            }
+        }
+    }
+
+    void write() const {
+        auto tmp = path_;
+        tmp += std::format(".tmp{}", std::chrono::steady_clock::now().time_since_epoch().count());
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            if (!out) {
+                throw std::system_error(errno, std::system_category(),
+                                        std::format("Failed to create {}", tmp.string()));
+            }
+            stats().write_metrics(out);
+            out.close();
+            if (!out) {
+                std::error_code ec;
+                std::filesystem::remove(tmp, ec);
+                throw std::system_error(errno, std::system_category(),
+                                        std::format("Failed to write {}", tmp.string()));
+            }
+        }
+        std::filesystem::rename(tmp, path_);
+    }
+
+    std::filesystem::path path_;
+    bool closed_ = false;
+    std::jthread thread_;
+};
+
+} // namespace pil
+
+#endif // PIL_METRICS_HPP
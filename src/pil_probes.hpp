@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_PROBES_HPP
+#define PIL_PROBES_HPP
+
+// USDT probes for bpftrace, perf and SystemTap, under provider "pil":
+//
+//   job_start(op)                       op is "squash" or "split"
+//   job_end(op, ok)                     ok is 0 when the job threw
+//   header_parsed(phnum, elf_class)
+//   segment_read_begin/end(index, offset, size)
+//   segment_write_begin/end(index, offset, size)
+//   hash_append(index, offset, size)
+//
+// Offsets are in the image. A probe is a single NOP in the code plus an ELF
+// note; nothing runs unless a tracer attaches, e.g.
+//
+//   bpftrace -e 'usdt:./pil-splitter:pil:segment_write_begin { ... }'
+//
+// Without <sys/sdt.h> (systemtap-sdt-dev), or with PIL_NO_USDT defined, the
+// probes compile to nothing.
+
+#if !defined(PIL_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PIL_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef PIL_HAVE_USDT
+#define PIL_PROBE1(name, a) DTRACE_PROBE1(pil, name, a)
+#define PIL_PROBE2(name, a, b) DTRACE_PROBE2(pil, name, a, b)
+#define PIL_PROBE3(name, a, b, c) DTRACE_PROBE3(pil, name, a, b, c)
+#else
+#define PIL_PROBE1(name, a) do { (void)(a); } while (0)
+#define PIL_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define PIL_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#include <exception>
+
+namespace pil {
+
+// Fires job_start now and job_end when the scope is left, with ok = 0 if it
+// is left by an exception
+class ProbeJob {
+public:
+    explicit ProbeJob(const char* op) noexcept
+        : op_(op), exceptions_(std::uncaught_exceptions())
+    {
+        PIL_PROBE1(job_start, op_);
+    }
+
+    ProbeJob(const ProbeJob&) = delete;
+    ProbeJob& operator=(const ProbeJob&) = delete;
+
+    ~ProbeJob() {
+        int ok = std::uncaught_exceptions() == exceptions_;
+        PIL_PROBE2(job_end, op_, ok);
+    }
+
+private:
+    const char* op_;
+    int exceptions_;
+};
+
+} // namespace pil
+
+#endif // PIL_PROBES_HPP
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_PROGRESS_HPP
+#define PIL_PROGRESS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <format>
+#include <mutex>
+#include <ostream>
+#include <stop_token>
+#include <thread>
+
+namespace pil {
+
+// Progress for --progress. The copy loops only store into a few relaxed
+// atomics once per segment; a ticker thread samples them at a fixed rate and
+// does all the formatting and output, so progress never adds I/O to the
+// copy path however small the segments are.
+
+class Progress {
+public:
+    bool enabled() const noexcept { return enabled_.load(std::memory_order_relaxed); }
+    void enable() noexcept { enabled_.store(true, std::memory_order_relaxed); }
+
+    // Called once the headers are parsed and the work is known
+    void begin(uint64_t total_bytes, size_t segments) noexcept {
+        if (!enabled()) return;
+        total_bytes_.store(total_bytes, std::memory_order_relaxed);
+        segments_.store(segments, std::memory_order_relaxed);
+        done_bytes_.store(0, std::memory_order_relaxed);
+        segment_.store(0, std::memory_order_relaxed);
+    }
+
+    void start_segment(size_t index) noexcept {
+        if (enabled()) segment_.store(index, std::memory_order_relaxed);
+    }
+
+    void add_bytes(uint64_t bytes) noexcept {
+        if (enabled()) done_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    struct Snapshot {
+        uint64_t done_bytes;
+        uint64_t total_bytes;
+        size_t segment;
+        size_t segments;
+    };
+
+    Snapshot snapshot() const noexcept {
+        return {done_bytes_.load(std::memory_order_relaxed),
+                total_bytes_.load(std::memory_order_relaxed),
+                segment_.load(std::memory_order_relaxed),
+                segments_.load(std::memory_order_relaxed)};
+    }
+
+private:
+    std::atomic<bool> enabled_{false};
+    std::atomic<uint64_t> total_bytes_{0};
+    std::atomic<uint64_t> done_bytes_{0};
+    std::atomic<size_t> segment_{0};
+    std::atomic<size_t> segments_{0};
+};
+
+inline constinit Progress process_progress;
+
+inline Progress& progress() noexcept {
+    return process_progress;
+}
+
+// Redraws progress from a background thread until destroyed. The human
+// form rewrites one line in place; the machine form prints one JSON object
+// per line, with a final one carrying "done": true.
+class ProgressTicker {
+public:
+    ProgressTicker(std::ostream& out, bool json)
+        : out_(out), json_(json), start_(std::chrono::steady_clock::now()), samples_{{start_, 0}}
+    {
+        progress().enable();
+        thread_ = std::jthread([this](std::stop_token stop) { run(stop); });
+    }
+
+    ProgressTicker(const ProgressTicker&) = delete;
+    ProgressTicker& operator=(const ProgressTicker&) = delete;
+
+    ~ProgressTicker() {
+        thread_.request_stop();
+        thread_.join();
+        print(true);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Throughput is averaged over this window, so ETA follows the current
+    // rate instead of the whole run's
+    static constexpr auto WINDOW = std::chrono::seconds(5);
+
+    void run(std::stop_token stop) {
+        auto interval = json_ ? std::chrono::milliseconds(1000) : std::chrono::milliseconds(250);
+        std::mutex mutex;
+        std::condition_variable_any wake;
+        std::unique_lock lock(mutex);
+        while (true) {
+            // Nothing notifies; this sleeps for the interval or until stopped
+            wake.wait_for(lock, stop, interval, [] { return false; });
+            if (stop.stop_requested()) return;
+            print(false);
+        }
+    }
+
+    void print(bool done) {
+        auto now = Clock::now();
+        auto s = progress().snapshot();
+
+        samples_.emplace_back(now, s.done_bytes);
+        while (samples_.size() > 2 && now - samples_.front().first > WINDOW) {
+            samples_.pop_front();
+        }
+        auto [then, then_bytes] = samples_.front();
+        double window = std::chrono::duration<double>(now - then).count();
+        double rate = window > 0 ? (s.done_bytes - then_bytes) / window : 0;
+        double elapsed = std::chrono::duration<double>(now - start_).count();
+        double eta = rate > 0 && s.total_bytes > s.done_bytes ? (s.total_bytes - s.done_bytes) / rate : 0;
+        size_t segment = done ? s.segments : std::min(s.segment + 1, s.segments);
+
+        if (json_) {
+            out_ << std::format("{{\"bytes_done\": {}, \"bytes_total\": {}, \"segment\": {}, "
+                                "\"segments\": {}, \"rate_bps\": {:.0f}, \"eta_s\": {:.1f}, "
+                                "\"elapsed_s\": {:.1f}{}}}\n",
+                                s.done_bytes, s.total_bytes, segment, s.segments, rate, eta,
+                                elapsed, done ? ", \"done\": true" : "");
+        } else {
+            double percent = s.total_bytes ? 100.0 * s.done_bytes / s.total_bytes : 0;
+            auto eta_s = static_cast<uint64_t>(eta);
+            out_ << std::format("\r[{:3.0f}%] {:.1f} / {:.1f} MiB  segment {}/{}  {:.1f} MiB/s  "
+                                "ETA {}:{:02}:{:02}{}",
+                                percent, s.done_bytes / 1048576.0, s.total_bytes / 1048576.0,
+                                segment, s.segments, rate / 1048576.0,
+                                eta_s / 3600, eta_s / 60 % 60, eta_s % 60, done ? "\n" : "  ");
+        }
+        out_.flush();
+    }
+
+    std::ostream& out_;
+    bool json_;
+    Clock::time_point start_;
+    std::deque<std::pair<Clock::time_point, uint64_t>> samples_;
+    std::jthread thread_;
+};
+
+} // namespace pil
+
+#endif // PIL_PROGRESS_HPP
@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_SIMG_HPP
+#define PIL_SIMG_HPP
+
+#include "pil_common.hpp"
+
+namespace pil {
+
+// Android sparse image (simg) writer, as consumed by fastboot.
+//
+// The image is a sequence of 4 KiB blocks. Blocks no write touches become
+// DONT_CARE chunks, blocks that repeat a single 32-bit word become FILL
+// chunks, and everything else is stored in RAW chunks. Bytes of a touched
+// block that no write covers read as zero.
+
+constexpr uint32_t SIMG_MAGIC = 0xED26FF3A;
+constexpr uint16_t SIMG_CHUNK_RAW = 0xCAC1;
+constexpr uint16_t SIMG_CHUNK_FILL = 0xCAC2;
+constexpr uint16_t SIMG_CHUNK_DONT_CARE = 0xCAC3;
+constexpr uint32_t SIMG_BLOCK_SIZE = 4096;
+constexpr uint16_t SIMG_FILE_HEADER_SIZE = 28;
+constexpr uint16_t SIMG_CHUNK_HEADER_SIZE = 12;
+
+// RAW runs are buffered so their chunk header can be written up front
+constexpr uint32_t SIMG_MAX_RAW_BLOCKS = 256;
+
+class SimgWriter {
+public:
+    explicit SimgWriter(std::ofstream& out) : out_(out) {
+        // Placeholder; block and chunk totals are patched in by finish()
+        write_file_at(out_, 0, file_header());
+    }
+
+    // Writes must arrive in ascending, non-overlapping offset order
+    void write_at(uint64_t offset, std::span<const uint8_t> data) {
+        while (!data.empty()) {
+            uint64_t block = offset / SIMG_BLOCK_SIZE;
+
+            if (has_block_ && block != block_index_) {
+                flush_block();
+            }
+            if (!has_block_) {
+                if (block < next_block_) {
+                    throw Error(std::format("Overlapping write at offset {:#x}", offset));
+                }
+                if (block > next_block_) {
+                    add_run(Run::dont_care, block - next_block_);
+                }
+                std::ranges::fill(block_, 0);
+                block_index_ = block;
+                has_block_ = true;
+            }
+
+            size_t within = offset % SIMG_BLOCK_SIZE;
+            size_t len = std::min<size_t>(data.size(), SIMG_BLOCK_SIZE - within);
+            std::copy_n(data.begin(), len, block_.begin() + within);
+
+            data = data.subspan(len);
+            offset += len;
+        }
+    }
+
+    void finish() {
+        if (has_block_) {
+            flush_block();
+        }
+        emit_run();
+        write_file_at(out_, 0, file_header());
+    }
+
+private:
+    enum class Run { none, raw, fill, dont_care };
+
+    auto file_header() const -> std::vector<uint8_t> {
+        std::vector<uint8_t> hdr;
+        append_le<uint32_t>(hdr, SIMG_MAGIC);
+        append_le<uint16_t>(hdr, 1);    // major version
+        append_le<uint16_t>(hdr, 0);    // minor version
+        append_le<uint16_t>(hdr, SIMG_FILE_HEADER_SIZE);
+        append_le<uint16_t>(hdr, SIMG_CHUNK_HEADER_SIZE);
+        append_le<uint32_t>(hdr, SIMG_BLOCK_SIZE);
+        append_le<uint32_t>(hdr, static_cast<uint32_t>(next_block_));
+        append_le<uint32_t>(hdr, chunk_count_);
+        append_le<uint32_t>(hdr, 0);    // image checksum, unused
+        return hdr;
+    }
+
+    void flush_block() {
+        uint32_t first;
+        std::memcpy(&first, block_.data(), sizeof(first));
+
+        bool uniform = true;
+        for (size_t i = sizeof(first); i < block_.size() && uniform; i += sizeof(first)) {
+            uniform = std::memcmp(block_.data() + i, &first, sizeof(first)) == 0;
+        }
+
+        if (uniform) {
+            if (run_ == Run::fill && fill_value_ != first) {
+                emit_run();
+            }
+            fill_value_ = first;
+            add_run(Run::fill, 1);
+        } else {
+            add_run(Run::raw, 1);
+            raw_.insert(raw_.end(), block_.begin(), block_.end());
+        }
+
+        next_block_ = block_index_ + 1;
+        has_block_ = false;
+    }
+
+    void add_run(Run kind, uint64_t blocks) {
+        if (run_ != kind || (kind == Run::raw && run_blocks_ == SIMG_MAX_RAW_BLOCKS)) {
+            emit_run();
+            run_ = kind;
+        }
+        run_blocks_ += blocks;
+        if (kind == Run::dont_care) {
+            next_block_ += blocks;
+        }
+    }
+
+    void emit_run() {
+        while (run_ != Run::none && run_blocks_ > 0) {
+            // chunk_sz is 32-bit, so very long DONT_CARE/FILL runs are split
+            uint32_t blocks = static_cast<uint32_t>(std::min<uint64_t>(run_blocks_, UINT32_MAX / SIMG_BLOCK_SIZE));
+
+            std::vector<uint8_t> chunk;
+            uint32_t payload = run_ == Run::raw  ? blocks * SIMG_BLOCK_SIZE
+                             : run_ == Run::fill ? sizeof(uint32_t)
+                             : 0;
+            append_le<uint16_t>(chunk, run_ == Run::raw  ? SIMG_CHUNK_RAW
+                                     : run_ == Run::fill ? SIMG_CHUNK_FILL
+                                     : SIMG_CHUNK_DONT_CARE);
+            append_le<uint16_t>(chunk, 0);
+            append_le<uint32_t>(chunk, blocks);
+            append_le<uint32_t>(chunk, SIMG_CHUNK_HEADER_SIZE + payload);
+            if (run_ == Run::fill) {
+                // The fill word is the block's own bytes, not a number
+                auto bytes = std::bit_cast<std::array<uint8_t, 4>>(fill_value_);
+                chunk.insert(chunk.end(), bytes.begin(), bytes.end());
+            }
+            append_to_file(out_, chunk);
+
+            if (run_ == Run::raw) {
+                append_to_file(out_, raw_);
+                raw_.clear();
+            }
+
+            ++chunk_count_;
+            run_blocks_ -= blocks;
+        }
+        run_ = Run::none;
+        run_blocks_ = 0;
+    }
+
+    std::ofstream& out_;
+
+    std::vector<uint8_t> block_ = std::vector<uint8_t>(SIMG_BLOCK_SIZE);
+    uint64_t block_index_ = 0;
+    bool has_block_ = false;
+    uint64_t next_block_ = 0;
+
+    Run run_ = Run::none;
+    uint64_t run_blocks_ = 0;
+    uint32_t fill_value_ = 0;
+    std::vector<uint8_t> raw_;
+    uint32_t chunk_count_ = 0;
+};
+
+} // namespace pil
+
+#endif // PIL_SIMG_HPP
@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_SOCKET_HPP
+#define PIL_SOCKET_HPP
+
+#include <string>
+#include <vector>
+#include <filesystem>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pil_common.hpp"
+#include "pil_fd.hpp"
+
+namespace pil {
+
+// Unix domain stream sockets carrying newline-terminated text messages, with
+// file descriptors passed alongside as SCM_RIGHTS ancillary data
+
+constexpr size_t MAX_PASSED_FDS = 4;
+
+// Longest message accepted; requests are a command and two paths
+constexpr size_t MAX_MESSAGE_SIZE = 64 << 10;
+
+inline auto unix_address(const std::filesystem::path& path) -> sockaddr_un {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    auto native = path.native();
+    if (native.size() >= sizeof(addr.sun_path)) {
+        throw Error(std::format("Socket path too long: {}", path.string()));
+    }
+    std::memcpy(addr.sun_path, native.c_str(), native.size() + 1);
+    return addr;
+}
+
+inline UniqueFd listen_unix(const std::filesystem::path& path) {
+    auto addr = unix_address(path);
+
+    UniqueFd fd(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!fd) {
+        throw_system_error("Failed to create socket");
+    }
+
+    // A socket file left behind by a previous instance would block bind().
+    // Only a socket nobody listens on is stale; a live one belongs to a
+    // running instance and is left alone.
+    std::error_code ec;
+    if (std::filesystem::is_socket(path, ec)) {
+        UniqueFd probe(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (!probe) {
+            throw_system_error("Failed to create socket");
+        }
+        if (::connect(probe.get(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+            throw Error(std::format("Another instance is already running on {}", path.string()));
+        }
+        if (errno != ECONNREFUSED) {
+            throw_system_error(std::format("Failed to probe {}", path.string()));
+        }
+        std::filesystem::remove(path, ec);
+    }
+
+    if (::bind(fd.get(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        throw_system_error(std::format("Failed to bind {}", path.string()));
+    }
+    if (::listen(fd.get(), SOMAXCONN) != 0) {
+        throw_system_error(std::format("Failed to listen on {}", path.string()));
+    }
+    return fd;
+}
+
+inline UniqueFd connect_unix(const std::filesystem::path& path) {
+    auto addr = unix_address(path);
+
+    UniqueFd fd(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!fd) {
+        throw_system_error("Failed to create socket");
+    }
+    if (::connect(fd.get(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        throw_system_error(std::format("Failed to connect to {}", path.string()));
+    }
+    return fd;
+}
+
+// Sends a message, passing fds with its first byte
+inline void send_message(int sock, std::string_view message, std::span<const int> fds = {}) {
+    if (fds.size() > MAX_PASSED_FDS) {
+        throw Error("Too many descriptors to pass");
+    }
+
+    while (!message.empty()) {
+        iovec iov{const_cast<char*>(message.data()), message.size()};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+        if (!fds.empty()) {
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        }
+
+        auto n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            throw_system_error("Failed to send message");
+        }
+        message.remove_prefix(static_cast<size_t>(n));
+        fds = {};
+    }
+}
+
+// Reads newline-terminated messages, collecting any descriptors that arrive
+class MessageReader {
+public:
+    explicit MessageReader(int sock) : sock_(sock) {}
+
+    // Returns false on end of stream; the newline is stripped
+    bool read_line(std::string& line, std::vector<UniqueFd>& fds) {
+        while (!next_line(line, fds)) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Takes a complete line already received, without reading the socket
+    bool next_line(std::string& line, std::vector<UniqueFd>& fds) {
+        auto newline = buffer_.find('\n');
+        if (newline == std::string::npos) {
+            return false;
+        }
+        line = buffer_.substr(0, newline);
+        buffer_.erase(0, newline + 1);
+        fds = std::move(fds_);
+        fds_.clear();
+        return true;
+    }
+
+    // Receives once, with MSG_DONTWAIT from a poll loop. Returns false on end
+    // of stream; a read that would block receives nothing.
+    bool fill(int flags = 0) {
+        while (true) {
+            char data[4096];
+            iovec iov{data, sizeof(data)};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            auto n = ::recvmsg(sock_, &msg, MSG_CMSG_CLOEXEC | flags);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && (flags & MSG_DONTWAIT)) {
+                return true;
+            }
+            if (n < 0) {
+                throw_system_error("Failed to receive message");
+            }
+
+            for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    for (size_t i = 0; i < count; ++i) {
+                        int fd;
+                        std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                        fds_.emplace_back(fd);
+                    }
+                }
+            }
+
+            if (n == 0) {
+                return false;
+            }
+            buffer_.append(data, static_cast<size_t>(n));
+            if (buffer_.size() > MAX_MESSAGE_SIZE && buffer_.find('\n') == std::string::npos) {
+                throw Error(std::format("Message exceeds {} bytes", MAX_MESSAGE_SIZE));
+            }
+            return true;
+        }
+    }
+
+private:
+    int sock_;
+    std::string buffer_;
+    std::vector<UniqueFd> fds_;
+};
+
+// Path through which a passed descriptor can be reopened by name
+inline auto fd_path(int fd) -> std::filesystem::path {
+    return std::format("/dev/fd/{}", fd);
+}
+
+} // namespace pil
+
+#endif // PIL_SOCKET_HPP
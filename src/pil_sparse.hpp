@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_SPARSE_HPP
+#define PIL_SPARSE_HPP
+
+#include "pil_common.hpp"
+#include "pil_fd.hpp"
+
+namespace pil {
+
+// Hole-aware I/O. Zero-filled blocks are left as holes on write, and holes in
+// the input are never read. Holes are tracked at filesystem block granularity.
+
+constexpr size_t SPARSE_BLOCK_SIZE = 4096;
+
+// Tests for an all-zero range by OR-reducing fixed 64-byte chunks of words;
+// the fixed-width inner loop is what lets the compiler vectorize it
+inline bool is_zero_block(std::span<const uint8_t> data) {
+    size_t i = 0;
+    for (; i + 64 <= data.size(); i += 64) {
+        uint64_t words[8];
+        std::memcpy(words, data.data() + i, sizeof(words));
+
+        uint64_t acc = 0;
+        for (uint64_t w : words) {
+            acc |= w;
+        }
+        if (acc != 0) {
+            return false;
+        }
+    }
+    for (; i < data.size(); ++i) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes data at offset, seeking over zero blocks instead of writing them.
+// The file must have been created truncated, so the skipped ranges read back
+// as zeros. That only holds past the current end of the file: below it, an
+// earlier overlapping write may have left data, so zero blocks there are
+// written out like any other. A trailing zero block still gets its last byte
+// written so that the file reaches its full length.
+inline void write_file_at_sparse(std::ofstream& file, size_t offset,
+                                 std::span<const uint8_t> data)
+{
+    file.seekp(0, std::ios::end);
+    auto written_end = static_cast<size_t>(file.tellp());
+
+    size_t run_start = 0;
+    size_t pos = 0;
+    bool last_zero = false;
+
+    while (pos < data.size()) {
+        size_t block = SPARSE_BLOCK_SIZE - (offset + pos) % SPARSE_BLOCK_SIZE;
+        size_t len = std::min(block, data.size() - pos);
+
+        last_zero = offset + pos >= written_end && is_zero_block(data.subspan(pos, len));
+        if (last_zero) {
+            if (run_start < pos) {
+                write_file_at(file, offset + run_start, data.subspan(run_start, pos - run_start));
+            }
+            run_start = pos + len;
+        }
+        pos += len;
+    }
+
+    if (run_start < data.size()) {
+        write_file_at(file, offset + run_start, data.subspan(run_start));
+    } else if (last_zero) {
+        write_file_at(file, offset + data.size() - 1, data.last(1));
+    }
+}
+
+struct Extent {
+    size_t offset;
+    size_t size;
+};
+
+// Data extents within [offset, offset + size); whatever lies between them is a
+// hole. Without SEEK_DATA support the whole range is reported as data.
+inline auto data_extents([[maybe_unused]] int fd, size_t offset, size_t size)
+    -> std::vector<Extent>
+{
+    std::vector<Extent> extents;
+    size_t end = offset + size;
+
+#if defined(__linux__) && defined(SEEK_DATA)
+    int saved_errno = errno;
+    size_t pos = offset;
+
+    while (pos < end) {
+        auto data = ::lseek(fd, static_cast<off_t>(pos), SEEK_DATA);
+        if (data < 0) {
+            // ENXIO: only a hole remains; anything else: no hole support
+            if (errno != ENXIO) {
+                extents.push_back({pos, end - pos});
+            }
+            break;
+        }
+        if (static_cast<size_t>(data) >= end) break;
+
+        auto hole = ::lseek(fd, data, SEEK_HOLE);
+        size_t extent_end = hole < 0 ? end : std::min(static_cast<size_t>(hole), end);
+
+        extents.push_back({static_cast<size_t>(data), extent_end - static_cast<size_t>(data)});
+        pos = extent_end;
+    }
+    errno = saved_errno;
+#else
+    extents.push_back({offset, end - offset});
+#endif
+
+    return extents;
+}
+
+inline size_t file_size_of([[maybe_unused]] int fd) {
+#ifdef __linux__
+    auto size = ::lseek(fd, 0, SEEK_END);
+    return size < 0 ? 0 : static_cast<size_t>(size);
+#else
+    return 0;
+#endif
+}
+
+// Reads [offset, offset + size) like read_file_at, but only the data extents
+// reported for fd are actually read; holes come back as zeros
+inline auto read_file_at_sparse(std::istream& file, const UniqueFd& fd, size_t offset, size_t size)
+    -> std::vector<uint8_t>
+{
+    if (!fd) {
+        return read_file_at(file, offset, size);
+    }
+
+    auto available = file_size_of(fd.get());
+    if (available < offset + size) {
+        throw Error(std::format("Incomplete read: expected {} bytes, got {} bytes at offset {}",
+                               size, available > offset ? available - offset : 0, offset));
+    }
+
+    std::vector<uint8_t> buffer(size);
+    for (auto [extent_offset, extent_size] : data_extents(fd.get(), offset, size)) {
+        read_file_into(file, extent_offset,
+                       std::span{buffer}.subspan(extent_offset - offset, extent_size));
+    }
+    return buffer;
+}
+
+} // namespace pil
+
+#endif // PIL_SPARSE_HPP
@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_SPLIT_HPP
+#define PIL_SPLIT_HPP
+
+#include <iostream>
+#include <filesystem>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "pil_common.hpp"
+#include "pil_archive.hpp"
+#include "pil_sparse.hpp"
+#include "pil_index.hpp"
+
+namespace pil {
+
+namespace fs = std::filesystem;
+
+struct SplitOptions {
+    bool sparse = false;    // leave zero blocks as holes, skip input holes
+    bool index = false;     // write a layout index sidecar for the image
+};
+
+inline void write_whole_file(const fs::path& path, std::span<const uint8_t> data, bool sparse) {
+    std::ofstream file;
+    {
+        ScopedIo timed(IoOp::open);
+        file.open(path, std::ios::binary | std::ios::trunc);
+    }
+    if (!file) {
+        throw_system_error(std::format("Failed to create {}", path.string()));
+    }
+    file.exceptions(std::ios::failbit | std::ios::badbit);
+
+    if (sparse) {
+        write_file_at_sparse(file, 0, data);
+    } else {
+        ScopedIo timed(IoOp::write);
+        file.write(reinterpret_cast<const char*>(data.data()), data.size());
+        stats().count_write(data.size());
+    }
+
+    ScopedIo timed(IoOp::sync);
+    file.close();
+}
+
+// Writes the mdt and each bXX as separate files next to each other
+class FileSetWriter {
+public:
+    FileSetWriter(const fs::path& mdt_path, const SplitOptions& options)
+        : mdt_path_(mdt_path), options_(options) {}
+
+    void write_mdt(std::span<const uint8_t> data) {
+        write_whole_file(mdt_path_, data, false);
+    }
+
+    void write_segment(size_t segment_index, std::span<const uint8_t> data) {
+        write_whole_file(segment_path(mdt_path_, segment_index), data, options_.sparse);
+    }
+
+private:
+    fs::path mdt_path_;
+    const SplitOptions& options_;
+};
+
+// Writes the mdt and each bXX as members of a single archive stream. Members
+// are named after the mdt's file name alone, so the archive never carries
+// host directories or ".." components.
+class ArchiveSetWriter {
+public:
+    ArchiveSetWriter(ArchiveWriter& archive, const fs::path& mdt_path)
+        : archive_(archive), mdt_path_(mdt_path.filename())
+    {
+        if (mdt_path_.empty() || mdt_path_ == "." || mdt_path_ == "..") {
+            throw Error(std::format("Invalid mdt member name {}", mdt_path.string()));
+        }
+    }
+
+    void write_mdt(std::span<const uint8_t> data) {
+        archive_.add_member(mdt_path_.generic_string(), data);
+    }
+
+    void write_segment(size_t segment_index, std::span<const uint8_t> data) {
+        archive_.add_member(segment_path(mdt_path_, segment_index).generic_string(), data);
+    }
+
+private:
+    ArchiveWriter& archive_;
+    fs::path mdt_path_;
+};
+
+// The mdt of a split image: the header block plus every hash segment,
+// appended after it
+template<typename ElfHeader, typename ElfPhdr>
+auto build_mdt(std::istream& mbn, const ElfHeader& ehdr, std::span<const ElfPhdr> phdrs,
+               bool is_little_endian) -> std::vector<uint8_t>
+{
+    auto mdt = header_block<ElfHeader, ElfPhdr>(mbn, ehdr, phdrs, is_little_endian);
+
+    // Hash segments (type 2) go into mdt after the program headers
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
+
+        if (p_filesz == 0 || !is_pil_hash_segment(p_flags)) continue;
+
+        ScopedPhase phase(Phase::hash_append);
+        TraceSpan span("hash append", p_filesz);
+        PIL_PROBE3(hash_append, i, p_offset, p_filesz);
+        auto segment = read_file_at(mbn, p_offset, p_filesz);
+        mdt.insert(mdt.end(), segment.begin(), segment.end());
+    }
+
+    return mdt;
+}
+
+template<typename ElfHeader, typename ElfPhdr, typename Writer>
+void split_impl(std::istream& mbn, const UniqueFd& mbn_fd, Writer& writer,
+                bool is_little_endian)
+{
+    ScopedPhase header_parse(Phase::header_parse);
+    auto ehdr = read_elf_header<ElfHeader>(mbn);
+    auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(mbn, ehdr, is_little_endian);
+    header_parse.stop();
+    PIL_PROBE2(header_parsed, phdrs.size(), ehdr.e_ident[EI_CLASS]);
+
+    // The mdt is small (headers plus hash segments), so it is assembled in
+    // memory and emitted before any bXX; archive writers rely on that order
+    auto mdt = build_mdt<ElfHeader, ElfPhdr>(mbn, ehdr, phdrs, is_little_endian);
+
+    {
+        TraceSpan span("write headers", mdt.size());
+        writer.write_mdt(mdt);
+    }
+
+    // Process each segment
+    progress().begin(segment_bytes<ElfPhdr>(phdrs, is_little_endian), phdrs.size());
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
+
+        if (p_filesz == 0) continue;
+
+        progress().start_segment(i);
+        ScopedPhase phase(Phase::segment_copy);
+        std::vector<uint8_t> segment;
+        {
+            TraceSpan span("read segment", p_filesz);
+            PIL_PROBE3(segment_read_begin, i, p_offset, p_filesz);
+            segment = read_file_at_sparse(mbn, mbn_fd, p_offset, p_filesz);
+            PIL_PROBE3(segment_read_end, i, p_offset, p_filesz);
+        }
+        TraceSpan span("write segment", p_filesz);
+        PIL_PROBE3(segment_write_begin, i, p_offset, p_filesz);
+        writer.write_segment(i, segment);
+        PIL_PROBE3(segment_write_end, i, p_offset, p_filesz);
+        progress().add_bytes(p_filesz);
+    }
+}
+
+template<typename Writer>
+void split_with(std::istream& mbn, const UniqueFd& mbn_fd, Writer& writer) {
+    TraceSpan span("split");
+    ProbeJob probe("split");
+    auto format = detect_elf_format(mbn);
+
+    if (format.elf_class == ELFCLASS32) {
+        split_impl<Elf32_Ehdr, Elf32_Phdr>(mbn, mbn_fd, writer, format.is_little_endian);
+    } else if (format.elf_class == ELFCLASS64) {
+        split_impl<Elf64_Ehdr, Elf64_Phdr>(mbn, mbn_fd, writer, format.is_little_endian);
+    }
+}
+
+// Hole queries need a descriptor; without one every segment is read in full
+inline auto open_hole_fd(const fs::path& mbn_path, const SplitOptions& options) -> UniqueFd {
+    return options.sparse ? open_fd(mbn_path, O_RDONLY) : UniqueFd();
+}
+
+inline auto open_mbn(const fs::path& mbn_path, const fs::path& mdt_path) -> std::ifstream {
+    if (mdt_path.extension() != ".mdt") {
+        throw Error(std::format("{} is not a .mdt file", mdt_path.string()));
+    }
+
+    std::ifstream mbn;
+    {
+        ScopedIo timed(IoOp::open);
+        mbn.open(mbn_path, std::ios::binary);
+    }
+    if (!mbn) {
+        throw_system_error(std::format("Failed to open {}", mbn_path.string()));
+    }
+    mbn.exceptions(std::ios::failbit | std::ios::badbit);
+    return mbn;
+}
+
+inline void split(const fs::path& mbn_path, const fs::path& mdt_path,
+                  const SplitOptions& options = {})
+{
+    CountedImage image;
+    ScopedPhase preflight(Phase::preflight);
+    auto mbn = open_mbn(mbn_path, mdt_path);
+    auto hole_fd = open_hole_fd(mbn_path, options);
+    FileSetWriter writer(mdt_path, options);
+    preflight.stop();
+
+    split_with(mbn, hole_fd, writer);
+
+    if (options.index) {
+        auto sidecar = mdt_path;
+        sidecar += PIL_INDEX_EXTENSION;
+        write_index_sidecar(mbn_path, sidecar, mdt_path.filename().string());
+    }
+}
+
+// Split into a single tar/cpio stream; "-" as archive path writes to stdout.
+// The layout index sidecar, if any, goes next to the archive.
+inline void split_to_archive(const fs::path& mbn_path, const fs::path& mdt_path,
+                             const fs::path& archive_path, ArchiveFormat format,
+                             const SplitOptions& options = {})
+{
+    if (options.index && archive_path == "-") {
+        throw Error("A layout index needs an archive file, not stdout");
+    }
+
+    CountedImage image;
+    ScopedPhase preflight(Phase::preflight);
+    auto mbn = open_mbn(mbn_path, mdt_path);
+
+    std::ofstream archive_file;
+    std::ostream* out = &std::cout;
+    if (archive_path != "-") {
+        ScopedIo timed(IoOp::open);
+        archive_file.open(archive_path, std::ios::binary | std::ios::trunc);
+        if (!archive_file) {
+            throw_system_error(std::format("Failed to create {}", archive_path.string()));
+        }
+        out = &archive_file;
+    } else {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    out->exceptions(std::ios::failbit | std::ios::badbit);
+
+    ArchiveWriter archive(*out, format);
+    ArchiveSetWriter writer(archive, mdt_path);
+    auto hole_fd = open_hole_fd(mbn_path, options);
+    preflight.stop();
+
+    split_with(mbn, hole_fd, writer);
+
+    ScopedPhase sync(Phase::sync);
+    {
+        ScopedIo timed(IoOp::sync);
+        archive.finish();
+        out->flush();
+    }
+    sync.stop();
+
+    if (options.index) {
+        auto sidecar = archive_path;
+        sidecar += PIL_INDEX_EXTENSION;
+        write_index_sidecar(mbn_path, sidecar, mdt_path.filename().string());
+    }
+}
+
+} // namespace pil
+
+#endif // PIL_SPLIT_HPP
@@ -0,0 +1,516 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_SQUASH_HPP
+#define PIL_SQUASH_HPP
+
+#include <map>
+#include <sstream>
+#include <optional>
+#include <filesystem>
+
+#include "pil_common.hpp"
+#include "pil_archive.hpp"
+#include "pil_fd.hpp"
+#include "pil_sparse.hpp"
+#include "pil_index.hpp"
+#include "pil_simg.hpp"
+#include "pil_cache.hpp"
+
+namespace pil {
+
+namespace fs = std::filesystem;
+
+struct SquashOptions {
+    bool sparse = false;    // leave zero blocks as holes, skip input holes
+    bool index = false;     // write a <mbn>.pilidx layout index sidecar
+    bool simg = false;      // write an Android sparse image instead of a plain mbn
+    fs::path cache_dir;     // result cache, disabled when empty
+    uint64_t cache_max_size = DEFAULT_CACHE_MAX_SIZE;
+};
+
+inline void write_squash_index(const fs::path& mbn_path, const SquashOptions& options) {
+    if (options.index) {
+        auto sidecar = mbn_path;
+        sidecar += PIL_INDEX_EXTENSION;
+        write_index_sidecar(mbn_path, sidecar, mbn_path.filename().string());
+    }
+}
+
+inline void write_segment_at(std::ofstream& mbn, size_t offset, std::span<const uint8_t> data,
+                             const SquashOptions& options)
+{
+    if (options.sparse) {
+        write_file_at_sparse(mbn, offset, data);
+    } else {
+        write_file_at(mbn, offset, data);
+    }
+}
+
+inline auto read_segment_data(const fs::path& mdt_path, size_t segment_index, size_t filesz,
+                              const SquashOptions& options)
+    -> std::vector<uint8_t>
+{
+    auto bxx_path = segment_path(mdt_path, segment_index);
+
+    std::ifstream bxx;
+    {
+        ScopedIo timed(IoOp::open);
+        bxx.open(bxx_path, std::ios::binary);
+    }
+    if (!bxx) {
+        throw_system_error(std::format("Failed to open required segment file {}",
+                                       bxx_path.string()));
+    }
+    bxx.exceptions(std::ios::failbit | std::ios::badbit);
+
+    if (options.sparse) {
+        return read_file_at_sparse(bxx, open_fd(bxx_path, O_RDONLY), 0, filesz);
+    }
+    return read_file_at(bxx, 0, filesz);
+}
+
+// Reads each non-hash segment from its bXX file next to the mdt
+class FileSetSource {
+public:
+    FileSetSource(const fs::path& mdt_path, const SquashOptions& options)
+        : mdt_path_(mdt_path), options_(options) {}
+
+    auto read_segment(size_t segment_index, size_t filesz) -> std::vector<uint8_t> {
+        TraceSpan span("read segment", filesz);
+        return read_segment_data(mdt_path_, segment_index, filesz, options_);
+    }
+
+    void copy_segment(size_t segment_index, size_t filesz, std::ofstream& mbn, size_t offset) {
+        PIL_PROBE3(segment_read_begin, segment_index, offset, filesz);
+        auto data = read_segment(segment_index, filesz);
+        PIL_PROBE3(segment_read_end, segment_index, offset, filesz);
+
+        TraceSpan span("write segment", filesz);
+        PIL_PROBE3(segment_write_begin, segment_index, offset, filesz);
+        write_segment_at(mbn, offset, data, options_);
+        PIL_PROBE3(segment_write_end, segment_index, offset, filesz);
+    }
+
+private:
+    fs::path mdt_path_;
+    const SquashOptions& options_;
+};
+
+// Serves each non-hash segment in place from its tar member, copying inside
+// the kernel where possible and through a buffer otherwise. Sparse output
+// always takes the buffered path, since only it can see the zero blocks.
+class ArchiveSource {
+public:
+    ArchiveSource(std::ifstream& archive, const TarIndex& index, const fs::path& mdt_name,
+                  UniqueFd archive_fd, UniqueFd mbn_fd, const SquashOptions& options)
+        : archive_(archive), index_(index), mdt_name_(mdt_name),
+          archive_fd_(std::move(archive_fd)), mbn_fd_(std::move(mbn_fd)), options_(options) {}
+
+    auto read_segment(size_t segment_index, size_t filesz) -> std::vector<uint8_t> {
+        TraceSpan span("read segment", filesz);
+        return read_file_at(archive_, find_member(segment_index, filesz).offset, filesz);
+    }
+
+    void copy_segment(size_t segment_index, size_t filesz, std::ofstream& mbn, size_t offset) {
+        auto member = &find_member(segment_index, filesz);
+
+        size_t copied = 0;
+        if (archive_fd_ && mbn_fd_ && !options_.sparse) {
+            // An in-kernel copy shows up as a write only
+            TraceSpan span("copy segment");
+            PIL_PROBE3(segment_write_begin, segment_index, offset, filesz);
+            mbn.flush();
+            copied = copy_file_range_at(archive_fd_.get(), member->offset,
+                                        mbn_fd_.get(), offset, filesz);
+            PIL_PROBE3(segment_write_end, segment_index, offset, copied);
+            span.set_bytes(copied);
+        }
+        if (copied < filesz) {
+            size_t rest = filesz - copied;
+            std::vector<uint8_t> data;
+            {
+                TraceSpan span("read segment", rest);
+                PIL_PROBE3(segment_read_begin, segment_index, offset + copied, rest);
+                data = read_file_at(archive_, member->offset + copied, rest);
+                PIL_PROBE3(segment_read_end, segment_index, offset + copied, rest);
+            }
+            TraceSpan span("write segment", data.size());
+            PIL_PROBE3(segment_write_begin, segment_index, offset + copied, rest);
+            write_segment_at(mbn, offset + copied, data, options_);
+            PIL_PROBE3(segment_write_end, segment_index, offset + copied, rest);
+        }
+    }
+
+private:
+    auto find_member(size_t segment_index, size_t filesz) -> const ArchiveMember& {
+        auto name = segment_path(mdt_name_, segment_index).generic_string();
+        auto member = index_.find(name);
+        if (!member) {
+            throw Error(std::format("Archive has no required segment member {}", name));
+        }
+        if (member->size < filesz) {
+            throw Error(std::format("Incomplete read: expected {} bytes, got {} bytes in {}",
+                                    filesz, member->size, name));
+        }
+        return *member;
+    }
+
+    std::ifstream& archive_;
+    const TarIndex& index_;
+    fs::path mdt_name_;
+    UniqueFd archive_fd_;
+    UniqueFd mbn_fd_;
+    const SquashOptions& options_;
+};
+
+template<typename ElfHeader, typename ElfPhdr, typename Source>
+void squash_impl(std::istream& mdt, std::ofstream& mbn, Source& source,
+                 const SquashOptions& options, bool is_little_endian)
+{
+    ScopedPhase header_parse(Phase::header_parse);
+    auto ehdr = read_elf_header<ElfHeader>(mdt);
+    auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(mdt, ehdr, is_little_endian);
+    header_parse.stop();
+    PIL_PROBE2(header_parsed, phdrs.size(), ehdr.e_ident[EI_CLASS]);
+
+    {
+        auto headers = header_block<ElfHeader, ElfPhdr>(mdt, ehdr, phdrs, is_little_endian);
+        TraceSpan span("write headers", headers.size());
+        write_file_at(mbn, 0, headers);
+    }
+
+    // Hash segments are stored sequentially in MDT after the first phdr filesz
+    size_t hash_offset = phdrs.empty() ? 0 : from_file_endian(phdrs[0].p_filesz, is_little_endian);
+
+    progress().begin(segment_bytes<ElfPhdr>(phdrs, is_little_endian), phdrs.size());
+
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
+
+        if (p_filesz == 0) continue;
+
+        progress().start_segment(i);
+        if (is_pil_hash_segment(p_flags)) {
+            ScopedPhase phase(Phase::hash_append);
+            TraceSpan span("hash append", p_filesz);
+            PIL_PROBE3(hash_append, i, p_offset, p_filesz);
+            write_segment_at(mbn, p_offset, read_file_at(mdt, hash_offset, p_filesz), options);
+            hash_offset += p_filesz;
+        } else {
+            ScopedPhase phase(Phase::segment_copy);
+            source.copy_segment(i, p_filesz, mbn, p_offset);
+        }
+        progress().add_bytes(p_filesz);
+    }
+}
+
+// Where each byte of a squashed image comes from
+struct SquashLayout {
+    struct Segment {
+        uint64_t filesz;
+        bool in_mdt;            // hash segments are stored in the mdt itself
+        uint64_t mdt_offset;
+    };
+
+    std::vector<uint8_t> headers;       // header_block() (piece source 0)
+    std::vector<Segment> segments;      // by segment index
+    std::vector<ImagePiece> pieces;     // disjoint and sorted
+    uint64_t size = 0;
+};
+
+template<typename ElfHeader, typename ElfPhdr>
+auto squash_layout_impl(std::istream& mdt, bool is_little_endian) -> SquashLayout {
+    auto ehdr = read_elf_header<ElfHeader>(mdt);
+    auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(mdt, ehdr, is_little_endian);
+
+    SquashLayout layout;
+    layout.headers = header_block<ElfHeader, ElfPhdr>(mdt, ehdr, phdrs, is_little_endian);
+
+    std::vector<ImagePiece> writes{{0, layout.headers.size(), 0, 0}};
+    layout.segments.resize(phdrs.size());
+
+    // Hash segments are stored sequentially in MDT after the first phdr filesz
+    size_t hash_offset = phdrs.empty() ? 0 : from_file_endian(phdrs[0].p_filesz, is_little_endian);
+
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
+
+        if (p_filesz == 0) continue;
+
+        bool in_mdt = is_pil_hash_segment(p_flags);
+        layout.segments[i] = {p_filesz, in_mdt, in_mdt ? hash_offset : 0};
+        if (in_mdt) {
+            hash_offset += p_filesz;
+        }
+        writes.push_back({p_offset, p_filesz, i + 1, 0});
+    }
+
+    layout.pieces = resolve_pieces(writes);
+    for (const auto& piece : layout.pieces) {
+        layout.size = std::max(layout.size, piece.offset + piece.size);
+    }
+    return layout;
+}
+
+inline auto squash_layout(std::istream& mdt) -> SquashLayout {
+    auto format = detect_elf_format(mdt);
+    if (format.elf_class == ELFCLASS32) {
+        return squash_layout_impl<Elf32_Ehdr, Elf32_Phdr>(mdt, format.is_little_endian);
+    }
+    return squash_layout_impl<Elf64_Ehdr, Elf64_Phdr>(mdt, format.is_little_endian);
+}
+
+// Squash into an Android sparse image. simg is written strictly in block
+// order, so the image layout is resolved first and then streamed; the gaps
+// between segments become DONT_CARE chunks.
+template<typename Source>
+void squash_simg(std::istream& mdt, std::ofstream& out, Source& source)
+{
+    ScopedPhase header_parse(Phase::header_parse);
+    auto layout = squash_layout(mdt);
+    header_parse.stop();
+    PIL_PROBE2(header_parsed, layout.segments.size(), layout.headers[EI_CLASS]);
+
+    SimgWriter simg(out);
+    std::vector<uint8_t> segment;
+    size_t loaded = 0;
+
+    uint64_t total = 0;
+    for (const auto& piece : layout.pieces) {
+        if (piece.source != 0) total += piece.size;
+    }
+    progress().begin(total, layout.segments.size());
+
+    for (const auto& piece : layout.pieces) {
+        if (piece.source == 0) {
+            TraceSpan span("write headers", piece.size);
+            simg.write_at(piece.offset,
+                          std::span{layout.headers}.subspan(piece.source_offset, piece.size));
+            continue;
+        }
+
+        size_t i = piece.source - 1;
+        ScopedPhase phase(layout.segments[i].in_mdt ? Phase::hash_append : Phase::segment_copy);
+        const auto& s = layout.segments[i];
+        uint64_t segment_offset = piece.offset - piece.source_offset;
+        if (loaded != piece.source) {
+            if (s.in_mdt) {
+                PIL_PROBE3(hash_append, i, segment_offset, s.filesz);
+                segment = read_file_at(mdt, s.mdt_offset, s.filesz);
+            } else {
+                PIL_PROBE3(segment_read_begin, i, segment_offset, s.filesz);
+                segment = source.read_segment(i, s.filesz);
+                PIL_PROBE3(segment_read_end, i, segment_offset, s.filesz);
+            }
+            loaded = piece.source;
+        }
+        TraceSpan span(s.in_mdt ? "hash append" : "write segment", piece.size);
+        progress().start_segment(i);
+        if (!s.in_mdt) PIL_PROBE3(segment_write_begin, i, piece.offset, piece.size);
+        simg.write_at(piece.offset, std::span{segment}.subspan(piece.source_offset, piece.size));
+        if (!s.in_mdt) PIL_PROBE3(segment_write_end, i, piece.offset, piece.size);
+        progress().add_bytes(piece.size);
+    }
+
+    simg.finish();
+}
+
+template<typename Source>
+void squash_with(std::istream& mdt, std::ofstream& mbn, Source& source,
+                 const SquashOptions& options)
+{
+    TraceSpan span("squash");
+    ProbeJob probe("squash");
+    auto format = detect_elf_format(mdt);
+
+    if (options.simg) {
+        squash_simg(mdt, mbn, source);
+    } else if (format.elf_class == ELFCLASS32) {
+        squash_impl<Elf32_Ehdr, Elf32_Phdr>(mdt, mbn, source, options, format.is_little_endian);
+    } else if (format.elf_class == ELFCLASS64) {
+        squash_impl<Elf64_Ehdr, Elf64_Phdr>(mdt, mbn, source, options, format.is_little_endian);
+    }
+}
+
+inline auto create_mbn(const fs::path& mbn_path) -> std::ofstream {
+    std::ofstream mbn;
+    {
+        ScopedIo timed(IoOp::open);
+        mbn.open(mbn_path, std::ios::binary | std::ios::trunc);
+    }
+    if (!mbn) {
+        throw_system_error(std::format("Failed to create {}", mbn_path.string()));
+    }
+    mbn.exceptions(std::ios::failbit | std::ios::badbit);
+    return mbn;
+}
+
+// Segments that squash reads from bXX files rather than from the mdt
+template<typename ElfHeader, typename ElfPhdr>
+auto bxx_segments(std::istream& mdt, bool is_little_endian) -> std::vector<size_t> {
+    auto ehdr = read_elf_header<ElfHeader>(mdt);
+    auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(mdt, ehdr, is_little_endian);
+
+    std::vector<size_t> segments;
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
+        if (p_filesz != 0 && !is_pil_hash_segment(p_flags)) {
+            segments.push_back(i);
+        }
+    }
+    return segments;
+}
+
+// Cache key over everything the output depends on: the output format and
+// the digests of the mdt and every bXX it needs. Returns nothing if an input
+// is missing, leaving the error to the regular squash path.
+inline auto squash_cache_key(std::istream& mdt, const fs::path& mdt_path,
+                             ResultCache& cache, const SquashOptions& options)
+    -> std::optional<std::string>
+{
+    auto format = detect_elf_format(mdt);
+    auto segments = format.elf_class == ELFCLASS32
+        ? bxx_segments<Elf32_Ehdr, Elf32_Phdr>(mdt, format.is_little_endian)
+        : bxx_segments<Elf64_Ehdr, Elf64_Phdr>(mdt, format.is_little_endian);
+
+    std::string material = std::format("pil-squash 1 simg={}\nmdt {}\n", options.simg,
+                                       to_hex(cache.file_digest(mdt_path)));
+    for (auto i : segments) {
+        auto bxx_path = segment_path(mdt_path, i);
+        std::error_code ec;
+        if (!fs::is_regular_file(bxx_path, ec)) {
+            return std::nullopt;
+        }
+        material += std::format("b{} {}\n", i, to_hex(cache.file_digest(bxx_path)));
+    }
+
+    return to_hex(Sha256::of(std::span{reinterpret_cast<const uint8_t*>(material.data()),
+                                       material.size()}));
+}
+
+inline void squash(const fs::path& mdt_path, const fs::path& mbn_path,
+                   const SquashOptions& options = {})
+{
+    if (mdt_path.extension() != ".mdt") {
+        throw Error(std::format("{} is not a .mdt file", mdt_path.string()));
+    }
+
+    CountedImage image;
+    ScopedPhase preflight(Phase::preflight);
+    std::ifstream mdt;
+    {
+        ScopedIo timed(IoOp::open);
+        mdt.open(mdt_path, std::ios::binary);
+    }
+    if (!mdt) {
+        throw_system_error(std::format("Failed to open {}", mdt_path.string()));
+    }
+    mdt.exceptions(std::ios::failbit | std::ios::badbit);
+
+    std::optional<ResultCache> cache;
+    std::optional<std::string> key;
+    if (!options.cache_dir.empty()) {
+        cache.emplace(options.cache_dir, options.cache_max_size);
+        key = squash_cache_key(mdt, mdt_path, *cache, options);
+        bool hit = key && cache->fetch(*key, mbn_path);
+        stats().count_cache_lookup(hit);
+        if (hit) {
+            write_squash_index(mbn_path, options);
+            return;
+        }
+    }
+
+    auto mbn = create_mbn(mbn_path);
+    FileSetSource source(mdt_path, options);
+    preflight.stop();
+
+    squash_with(mdt, mbn, source, options);
+
+    ScopedPhase sync(Phase::sync);
+    {
+        ScopedIo timed(IoOp::sync);
+        mbn.close();
+    }
+    sync.stop();
+    if (key) {
+        cache->store(*key, mbn_path);
+    }
+    write_squash_index(mbn_path, options);
+}
+
+// Squash an mdt + bXX set stored as members of an uncompressed tar archive
+inline void squash_from_archive(const fs::path& archive_path, const fs::path& mdt_name,
+                                const fs::path& mbn_path, const SquashOptions& options = {})
+{
+    if (mdt_name.extension() != ".mdt") {
+        throw Error(std::format("{} is not a .mdt file", mdt_name.string()));
+    }
+
+    CountedImage image;
+    ScopedPhase preflight(Phase::preflight);
+    std::ifstream archive;
+    {
+        ScopedIo timed(IoOp::open);
+        archive.open(archive_path, std::ios::binary);
+    }
+    if (!archive) {
+        throw_system_error(std::format("Failed to open {}", archive_path.string()));
+    }
+    archive.exceptions(std::ios::failbit | std::ios::badbit);
+
+    // The whole archive is the input here, so it alone keys the result
+    std::optional<ResultCache> cache;
+    std::string key;
+    if (!options.cache_dir.empty()) {
+        cache.emplace(options.cache_dir, options.cache_max_size);
+        auto material = std::format("pil-squash-tar 1 simg={}\n{}\n{}\n", options.simg,
+                                    mdt_name.generic_string(),
+                                    to_hex(cache->file_digest(archive_path)));
+        key = to_hex(Sha256::of(std::span{reinterpret_cast<const uint8_t*>(material.data()),
+                                          material.size()}));
+        bool hit = cache->fetch(key, mbn_path);
+        stats().count_cache_lookup(hit);
+        if (hit) {
+            write_squash_index(mbn_path, options);
+            return;
+        }
+    }
+
+    TarIndex index(archive);
+
+    auto mdt_member = index.find(mdt_name.generic_string());
+    if (!mdt_member) {
+        throw Error(std::format("{} not found in {}", mdt_name.string(), archive_path.string()));
+    }
+
+    // The mdt only holds headers and hash segments, so it is parsed from memory
+    auto mdt_data = read_file_at(archive, mdt_member->offset, mdt_member->size);
+    std::istringstream mdt(std::string(mdt_data.begin(), mdt_data.end()));
+    mdt.exceptions(std::ios::failbit | std::ios::badbit);
+
+    auto mbn = create_mbn(mbn_path);
+
+    ArchiveSource source(archive, index, mdt_name,
+                         open_fd(archive_path, O_RDONLY), open_fd(mbn_path, O_WRONLY),
+                         options);
+    preflight.stop();
+
+    squash_with(mdt, mbn, source, options);
+
+    ScopedPhase sync(Phase::sync);
+    {
+        ScopedIo timed(IoOp::sync);
+        mbn.close();
+    }
+    sync.stop();
+    if (cache) {
+        cache->store(key, mbn_path);
+    }
+    write_squash_index(mbn_path, options);
+}
+
+} // namespace pil
+
+#endif // PIL_SQUASH_HPP
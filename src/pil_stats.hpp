@@ -0,0 +1,519 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_STATS_HPP
+#define PIL_STATS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <exception>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+namespace pil {
+
+// Run statistics for --stats and --metrics: wall and CPU time per phase,
+// bytes moved by the I/O helpers, images and cache lookups, and process
+// counters. Recording sits behind one relaxed atomic load of the enabled
+// flag, so it costs next to nothing when off.
+
+enum class Phase : uint8_t {
+    header_parse,   // ELF and program headers
+    preflight,      // opening inputs and outputs, cache lookups
+    segment_copy,   // bXX data
+    hash_append,    // hash segment data
+    sync,           // flushing and closing outputs
+};
+
+constexpr size_t PHASE_COUNT = 5;
+constexpr std::array<std::string_view, PHASE_COUNT> PHASE_NAMES = {
+    "header parse", "pre-flight", "segment copy", "hash append", "sync",
+};
+constexpr std::array<std::string_view, PHASE_COUNT> PHASE_LABELS = {
+    "header_parse", "preflight", "segment_copy", "hash_append", "sync",
+};
+
+// Upper bounds of the phase latency buckets in seconds; one more bucket
+// takes everything slower
+constexpr std::array<double, 16> PHASE_BUCKETS = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+// A bucket bound as an "le" label, always with a fraction ("1.0", not "1"),
+// which is the form OpenMetrics requires; the series keep their names if
+// the output ever switches to it
+inline std::string bucket_label(double bound) {
+    auto label = std::format("{}", bound);
+    if (label.find_first_of(".e") == std::string::npos) {
+        label += ".0";
+    }
+    return label;
+}
+
+// Calls into the I/O layer, timed one by one
+enum class IoOp : uint8_t {
+    open,           // opening an input or output file
+    read,           // positional read
+    write,          // positional write or append
+    copy,           // in-kernel copy_file_range
+    sync,           // flushing and closing an output
+};
+
+constexpr size_t IO_OP_COUNT = 5;
+constexpr std::array<std::string_view, IO_OP_COUNT> IO_OP_NAMES = {
+    "open", "read", "write", "copy", "sync",
+};
+
+// Log-bucketed latency histogram in the manner of HdrHistogram. Each power
+// of two of nanoseconds is split into 8 linear sub-buckets, so any recorded
+// value is within 12.5% of its bucket's bounds across the whole uint64_t
+// range. Only one thread records into a histogram; readers may run
+// concurrently, hence the relaxed atomics.
+class LatencyHistogram {
+public:
+    static constexpr unsigned SUB_BITS = 3;
+    static constexpr size_t SUB_COUNT = size_t{1} << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    static constexpr size_t bucket(uint64_t ns) noexcept {
+        if (ns < 2 * SUB_COUNT) {
+            return static_cast<size_t>(ns);
+        }
+        unsigned shift = static_cast<unsigned>(std::bit_width(ns)) - 1 - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + ((ns >> shift) & (SUB_COUNT - 1));
+    }
+
+    // Largest value that falls into bucket i
+    static constexpr uint64_t bucket_max(size_t i) noexcept {
+        if (i < 2 * SUB_COUNT) {
+            return i;
+        }
+        auto shift = static_cast<unsigned>(i / SUB_COUNT - 1);
+        return ((SUB_COUNT + i % SUB_COUNT + 1) << shift) - 1;
+    }
+
+    // Called only by the owning thread
+    void record(uint64_t ns) noexcept {
+        bump(counts_[bucket(ns)], 1);
+        bump(count_, 1);
+        bump(total_ns_, ns);
+        if (ns > max_ns_.load(std::memory_order_relaxed)) {
+            max_ns_.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void merge(const LatencyHistogram& other) noexcept {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            bump(counts_[i], other.counts_[i].load(std::memory_order_relaxed));
+        }
+        bump(count_, other.count());
+        bump(total_ns_, other.total_ns());
+        max_ns_.store(std::max(max_ns(), other.max_ns()), std::memory_order_relaxed);
+    }
+
+    uint64_t count() const noexcept { return count_.load(std::memory_order_relaxed); }
+    uint64_t total_ns() const noexcept { return total_ns_.load(std::memory_order_relaxed); }
+    uint64_t max_ns() const noexcept { return max_ns_.load(std::memory_order_relaxed); }
+
+    // Nearest-rank percentile, p in [0, 100], reported as the upper bound of
+    // its bucket and never above the largest value seen
+    uint64_t percentile_ns(double p) const noexcept {
+        auto n = count();
+        if (n == 0) {
+            return 0;
+        }
+        auto rank = std::clamp<uint64_t>(static_cast<uint64_t>(p / 100 * n + 0.999999), 1, n);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(bucket_max(i), max_ns());
+            }
+        }
+        return max_ns();
+    }
+
+private:
+    static void bump(std::atomic<uint64_t>& value, uint64_t by) noexcept {
+        value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    std::array<std::atomic<uint64_t>, BUCKETS> counts_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> total_ns_{0};
+    std::atomic<uint64_t> max_ns_{0};
+};
+
+// Process-wide counters; deltas of two snapshots cover what happened between
+struct ProcessCounters {
+    uint64_t read_syscalls = 0;     // read-class syscalls, from /proc/self/io
+    uint64_t write_syscalls = 0;    // write-class syscalls
+    uint64_t read_bytes = 0;        // bytes passed to read-class syscalls
+    uint64_t write_bytes = 0;
+    double cpu_seconds = 0;         // user + system
+    uint64_t peak_rss_kb = 0;       // high-water mark, never decreases
+
+    static ProcessCounters now() {
+        ProcessCounters c;
+
+        std::ifstream io("/proc/self/io");
+        std::string key;
+        uint64_t value;
+        while (io >> key >> value) {
+            if (key == "syscr:") c.read_syscalls = value;
+            else if (key == "syscw:") c.write_syscalls = value;
+            else if (key == "rchar:") c.read_bytes = value;
+            else if (key == "wchar:") c.write_bytes = value;
+        }
+
+#if defined(__unix__) || defined(__APPLE__)
+        rusage usage{};
+        ::getrusage(RUSAGE_SELF, &usage);
+        c.cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+        c.peak_rss_kb = static_cast<uint64_t>(usage.ru_maxrss) / 1024;
+#else
+        c.peak_rss_kb = static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+#endif
+        return c;
+    }
+
+    ProcessCounters operator-(const ProcessCounters& before) const {
+        ProcessCounters d = *this;
+        d.read_syscalls -= before.read_syscalls;
+        d.write_syscalls -= before.write_syscalls;
+        d.read_bytes -= before.read_bytes;
+        d.write_bytes -= before.write_bytes;
+        d.cpu_seconds -= before.cpu_seconds;
+        return d;
+    }
+};
+
+// CPU time of the calling thread, zero where unavailable
+inline uint64_t thread_cpu_ns() noexcept {
+#if defined(__unix__) || defined(__APPLE__)
+    timespec ts;
+    if (::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+    }
+#endif
+    return 0;
+}
+
+class Stats {
+public:
+    bool enabled() const noexcept { return enabled_.load(std::memory_order_relaxed); }
+
+    void enable() {
+        start_ = std::chrono::steady_clock::now();
+        before_ = ProcessCounters::now();
+        enabled_.store(true, std::memory_order_relaxed);
+    }
+
+    void add_phase(Phase phase, uint64_t wall_ns, uint64_t cpu_ns) noexcept {
+        auto& p = phases_[static_cast<size_t>(phase)];
+        p.wall_ns.fetch_add(wall_ns, std::memory_order_relaxed);
+        p.cpu_ns.fetch_add(cpu_ns, std::memory_order_relaxed);
+        p.count.fetch_add(1, std::memory_order_relaxed);
+
+        auto bucket = std::ranges::lower_bound(PHASE_BUCKETS, wall_ns / 1e9) - PHASE_BUCKETS.begin();
+        p.buckets[static_cast<size_t>(bucket)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_read(uint64_t bytes) noexcept { add(read_, bytes); }
+    void count_write(uint64_t bytes) noexcept { add(write_, bytes); }
+    void count_copy(uint64_t bytes) noexcept { add(copy_, bytes); }
+
+    // An image squashed or split, or one that failed on the way
+    void count_image(bool ok) noexcept {
+        if (enabled()) (ok ? images_ok_ : images_failed_).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_cache_lookup(bool hit) noexcept {
+        if (enabled()) (hit ? cache_hits_ : cache_misses_).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Each thread records into its own histograms; they are merged when read
+    void record_io(IoOp op, uint64_t ns) {
+        local_io().ops[static_cast<size_t>(op)].record(ns);
+    }
+
+    auto io_latency(IoOp op) const -> std::unique_ptr<LatencyHistogram> {
+        auto merged = std::make_unique<LatencyHistogram>();
+        std::lock_guard lock(io_mutex_);
+        for (const auto& buffer : io_buffers_) {
+            merged->merge(buffer->ops[static_cast<size_t>(op)]);
+        }
+        return merged;
+    }
+
+    // Prints the report as a table, or as a single JSON object
+    void report(std::ostream& out, bool json) const {
+        auto counters = ProcessCounters::now() - before_;
+        double total_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start_).count();
+
+        auto ms = [](const std::atomic<uint64_t>& ns) {
+            return ns.load(std::memory_order_relaxed) / 1e6;
+        };
+        auto get = [](const std::atomic<uint64_t>& v) { return v.load(std::memory_order_relaxed); };
+
+        if (json) {
+            out << "{\"phases\": {";
+            for (size_t i = 0; i < PHASE_COUNT; ++i) {
+                const auto& p = phases_[i];
+                out << std::format("{}\"{}\": {{\"wall_ms\": {:.3f}, \"cpu_ms\": {:.3f}, \"count\": {}}}",
+                                   i ? ", " : "", PHASE_NAMES[i], ms(p.wall_ns), ms(p.cpu_ns),
+                                   get(p.count));
+            }
+            out << std::format("}}, \"wall_ms\": {:.3f}, \"cpu_ms\": {:.3f}, "
+                               "\"bytes_read\": {}, \"read_calls\": {}, "
+                               "\"bytes_written\": {}, \"write_calls\": {}, "
+                               "\"bytes_copied\": {}, \"copy_calls\": {}, "
+                               "\"images\": {}, \"images_failed\": {}, "
+                               "\"cache_hits\": {}, \"cache_misses\": {}, "
+                               "\"read_syscalls\": {}, \"write_syscalls\": {}, "
+                               "\"peak_rss_kb\": {}, \"io_latency_us\": {{",
+                               total_ms, counters.cpu_seconds * 1e3,
+                               get(read_.bytes), get(read_.calls),
+                               get(write_.bytes), get(write_.calls),
+                               get(copy_.bytes), get(copy_.calls),
+                               get(images_ok_), get(images_failed_),
+                               get(cache_hits_), get(cache_misses_),
+                               counters.read_syscalls, counters.write_syscalls,
+                               counters.peak_rss_kb);
+            for (size_t i = 0; i < IO_OP_COUNT; ++i) {
+                auto h = io_latency(static_cast<IoOp>(i));
+                out << std::format("{}\"{}\": {{\"count\": {}, \"p50\": {:.3f}, \"p90\": {:.3f}, "
+                                   "\"p99\": {:.3f}, \"p99.9\": {:.3f}, \"max\": {:.3f}}}",
+                                   i ? ", " : "", IO_OP_NAMES[i], h->count(),
+                                   h->percentile_ns(50) / 1e3, h->percentile_ns(90) / 1e3,
+                                   h->percentile_ns(99) / 1e3, h->percentile_ns(99.9) / 1e3,
+                                   h->max_ns() / 1e3);
+            }
+            out << "}}\n";
+            return;
+        }
+
+        out << std::format("{:<14} {:>10} {:>10} {:>7}\n", "phase", "wall ms", "cpu ms", "count");
+        for (size_t i = 0; i < PHASE_COUNT; ++i) {
+            const auto& p = phases_[i];
+            out << std::format("{:<14} {:>10.3f} {:>10.3f} {:>7}\n",
+                               PHASE_NAMES[i], ms(p.wall_ns), ms(p.cpu_ns), get(p.count));
+        }
+        out << std::format("{:<14} {:>10.3f} {:>10.3f}\n", "total", total_ms,
+                           counters.cpu_seconds * 1e3);
+        out << std::format("read {} bytes in {} calls, wrote {} bytes in {} calls, "
+                           "copied {} bytes in kernel\n",
+                           get(read_.bytes), get(read_.calls), get(write_.bytes),
+                           get(write_.calls), get(copy_.bytes));
+        if (get(cache_hits_) || get(cache_misses_)) {
+            out << std::format("cache: {} hits, {} misses\n", get(cache_hits_), get(cache_misses_));
+        }
+        out << std::format("syscalls: {} read, {} write; peak RSS {} KiB\n",
+                           counters.read_syscalls, counters.write_syscalls, counters.peak_rss_kb);
+
+        out << std::format("{:<14} {:>7} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "I/O latency us",
+                           "count", "p50", "p90", "p99", "p99.9", "max");
+        for (size_t i = 0; i < IO_OP_COUNT; ++i) {
+            auto h = io_latency(static_cast<IoOp>(i));
+            if (h->count() == 0) continue;
+            out << std::format("{:<14} {:>7} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n",
+                               IO_OP_NAMES[i], h->count(), h->percentile_ns(50) / 1e3,
+                               h->percentile_ns(90) / 1e3, h->percentile_ns(99) / 1e3,
+                               h->percentile_ns(99.9) / 1e3, h->max_ns() / 1e3);
+        }
+    }
+
+    // Writes the counters as a Prometheus textfile, in the Prometheus text
+    // exposition format that node_exporter's textfile collector reads (not
+    // OpenMetrics). Counters start when stats are enabled.
+    void write_metrics(std::ostream& out) const {
+        auto counters = ProcessCounters::now() - before_;
+        auto get = [](const std::atomic<uint64_t>& v) { return v.load(std::memory_order_relaxed); };
+
+        out << "# HELP pil_images_total Images squashed or split.\n"
+               "# TYPE pil_images_total counter\n";
+        out << std::format("pil_images_total{{result=\"ok\"}} {}\n", get(images_ok_));
+        out << std::format("pil_images_total{{result=\"failed\"}} {}\n", get(images_failed_));
+
+        out << "# HELP pil_cache_lookups_total Result cache lookups.\n"
+               "# TYPE pil_cache_lookups_total counter\n";
+        out << std::format("pil_cache_lookups_total{{result=\"hit\"}} {}\n", get(cache_hits_));
+        out << std::format("pil_cache_lookups_total{{result=\"miss\"}} {}\n", get(cache_misses_));
+
+        out << "# HELP pil_bytes_total Bytes read, written and copied in the kernel.\n"
+               "# TYPE pil_bytes_total counter\n";
+        out << std::format("pil_bytes_total{{op=\"read\"}} {}\n", get(read_.bytes));
+        out << std::format("pil_bytes_total{{op=\"write\"}} {}\n", get(write_.bytes));
+        out << std::format("pil_bytes_total{{op=\"copy\"}} {}\n", get(copy_.bytes));
+
+        out << "# HELP pil_phase_seconds Wall time of each pass through a phase.\n"
+               "# TYPE pil_phase_seconds histogram\n";
+        for (size_t i = 0; i < PHASE_COUNT; ++i) {
+            const auto& p = phases_[i];
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < PHASE_BUCKETS.size(); ++b) {
+                cumulative += get(p.buckets[b]);
+                out << std::format("pil_phase_seconds_bucket{{phase=\"{}\",le=\"{}\"}} {}\n",
+                                   PHASE_LABELS[i], bucket_label(PHASE_BUCKETS[b]), cumulative);
+            }
+            out << std::format("pil_phase_seconds_bucket{{phase=\"{}\",le=\"+Inf\"}} {}\n",
+                               PHASE_LABELS[i], get(p.count));
+            out << std::format("pil_phase_seconds_sum{{phase=\"{}\"}} {:.9f}\n",
+                               PHASE_LABELS[i], get(p.wall_ns) / 1e9);
+            out << std::format("pil_phase_seconds_count{{phase=\"{}\"}} {}\n",
+                               PHASE_LABELS[i], get(p.count));
+        }
+
+        out << "# HELP pil_cpu_seconds_total User and system CPU time.\n"
+               "# TYPE pil_cpu_seconds_total counter\n";
+        out << std::format("pil_cpu_seconds_total {:.6f}\n", counters.cpu_seconds);
+        out << "# HELP pil_peak_rss_bytes Peak resident set size.\n"
+               "# TYPE pil_peak_rss_bytes gauge\n";
+        out << std::format("pil_peak_rss_bytes {}\n", counters.peak_rss_kb * 1024);
+    }
+
+private:
+    struct PhaseTotals {
+        std::atomic<uint64_t> wall_ns{0};
+        std::atomic<uint64_t> cpu_ns{0};
+        std::atomic<uint64_t> count{0};
+        std::array<std::atomic<uint64_t>, PHASE_BUCKETS.size() + 1> buckets{};
+    };
+
+    struct Traffic {
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> calls{0};
+    };
+
+    struct IoBuffer {
+        std::array<LatencyHistogram, IO_OP_COUNT> ops;
+    };
+
+    IoBuffer& local_io() {
+        thread_local IoBuffer* buffer = nullptr;
+        if (!buffer) {
+            std::lock_guard lock(io_mutex_);
+            buffer = io_buffers_.emplace_back(std::make_unique<IoBuffer>()).get();
+        }
+        return *buffer;
+    }
+
+    void add(Traffic& traffic, uint64_t bytes) noexcept {
+        if (enabled()) {
+            traffic.bytes.fetch_add(bytes, std::memory_order_relaxed);
+            traffic.calls.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::atomic<bool> enabled_{false};
+    std::chrono::steady_clock::time_point start_{};
+    ProcessCounters before_{};
+    std::array<PhaseTotals, PHASE_COUNT> phases_{};
+    Traffic read_, write_, copy_;
+    std::atomic<uint64_t> images_ok_{0}, images_failed_{0};
+    std::atomic<uint64_t> cache_hits_{0}, cache_misses_{0};
+    mutable std::mutex io_mutex_;
+    std::vector<std::unique_ptr<IoBuffer>> io_buffers_;
+};
+
+inline constinit Stats process_stats;
+
+inline Stats& stats() noexcept {
+    return process_stats;
+}
+
+// Charges the lifetime of the scope to a phase
+class ScopedPhase {
+public:
+    explicit ScopedPhase(Phase phase) noexcept : phase_(phase), active_(stats().enabled()) {
+        if (active_) {
+            wall_start_ = std::chrono::steady_clock::now();
+            cpu_start_ = thread_cpu_ns();
+        }
+    }
+
+    ScopedPhase(const ScopedPhase&) = delete;
+    ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+    ~ScopedPhase() { stop(); }
+
+    // Ends the phase before the scope does
+    void stop() noexcept {
+        if (active_) {
+            auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - wall_start_).count();
+            stats().add_phase(phase_, static_cast<uint64_t>(wall), thread_cpu_ns() - cpu_start_);
+            active_ = false;
+        }
+    }
+
+private:
+    Phase phase_;
+    bool active_;
+    std::chrono::steady_clock::time_point wall_start_;
+    uint64_t cpu_start_ = 0;
+};
+
+// Times the scope as one call into the I/O layer
+class ScopedIo {
+public:
+    explicit ScopedIo(IoOp op) noexcept : op_(op), active_(stats().enabled()) {
+        if (active_) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ScopedIo(const ScopedIo&) = delete;
+    ScopedIo& operator=(const ScopedIo&) = delete;
+
+    ~ScopedIo() {
+        if (active_) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_).count();
+            stats().record_io(op_, static_cast<uint64_t>(ns));
+        }
+    }
+
+private:
+    IoOp op_;
+    bool active_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Counts the scope as one image, a failed one if it is left by an exception
+class CountedImage {
+public:
+    CountedImage() noexcept : exceptions_(std::uncaught_exceptions()) {}
+
+    CountedImage(const CountedImage&) = delete;
+    CountedImage& operator=(const CountedImage&) = delete;
+
+    ~CountedImage() { stats().count_image(std::uncaught_exceptions() == exceptions_); }
+
+private:
+    int exceptions_;
+};
+
+} // namespace pil
+
+#endif // PIL_STATS_HPP
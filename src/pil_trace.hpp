@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_TRACE_HPP
+#define PIL_TRACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <filesystem>
+#include <system_error>
+
+namespace pil {
+
+// Timeline tracing for --trace: spans of segment reads and writes, header
+// writes, hash appends and jobs, written as Chrome trace events that
+// Perfetto and chrome://tracing load directly.
+//
+// Every thread appends to its own buffer, so recording a span takes no lock
+// and touches no shared cache line. A thread takes the registration lock
+// once, on its first span. Buffers outlive their threads and are only read
+// by write(), which must run after the traced threads are done.
+
+struct TraceEvent {
+    const char* name;       // static string
+    uint64_t start_ns;      // since tracing was enabled
+    uint64_t duration_ns;
+    uint64_t bytes;
+};
+
+class Tracer {
+public:
+    bool enabled() const noexcept { return enabled_.load(std::memory_order_relaxed); }
+
+    void enable() {
+        origin_ = std::chrono::steady_clock::now();
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    uint64_t now_ns() const noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - origin_).count();
+    }
+
+    void record(const TraceEvent& event) {
+        local().events.push_back(event);
+    }
+
+    void write(const std::filesystem::path& path) {
+        std::ofstream out(path, std::ios::trunc);
+        if (!out) {
+            throw std::system_error(errno, std::system_category(),
+                                    std::format("Failed to create {}", path.string()));
+        }
+
+        std::lock_guard lock(mutex_);
+        out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+        bool first = true;
+        for (const auto& buffer : buffers_) {
+            out << std::format("{}{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {}, "
+                               "\"args\": {{\"name\": \"thread {}\"}}}}",
+                               first ? "" : ",\n", buffer->tid, buffer->tid);
+            first = false;
+            for (const auto& e : buffer->events) {
+                out << std::format(",\n{{\"name\": \"{}\", \"cat\": \"pil\", \"ph\": \"X\", "
+                                   "\"ts\": {:.3f}, \"dur\": {:.3f}, \"pid\": 1, \"tid\": {}, "
+                                   "\"args\": {{\"bytes\": {}}}}}",
+                                   e.name, e.start_ns / 1e3, e.duration_ns / 1e3, buffer->tid, e.bytes);
+            }
+        }
+        out << "\n]}\n";
+        out.close();
+        if (!out) {
+            throw std::system_error(errno, std::system_category(),
+                                    std::format("Failed to write {}", path.string()));
+        }
+    }
+
+private:
+    struct Buffer {
+        uint32_t tid;       // in order of the first span, the first thread is 1
+        std::vector<TraceEvent> events;
+    };
+
+    Buffer& local() {
+        thread_local Buffer* buffer = nullptr;
+        if (!buffer) {
+            std::lock_guard lock(mutex_);
+            auto& added = buffers_.emplace_back(std::make_unique<Buffer>());
+            added->tid = static_cast<uint32_t>(buffers_.size());
+            added->events.reserve(1024);
+            buffer = added.get();
+        }
+        return *buffer;
+    }
+
+    std::atomic<bool> enabled_{false};
+    std::chrono::steady_clock::time_point origin_{};
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Buffer>> buffers_;
+};
+
+inline constinit Tracer process_tracer;
+
+inline Tracer& tracer() noexcept {
+    return process_tracer;
+}
+
+// Records the lifetime of the scope as a span; the byte count may be filled
+// in once known
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, uint64_t bytes = 0) noexcept
+        : name_(name), bytes_(bytes), active_(tracer().enabled())
+    {
+        if (active_) {
+            start_ns_ = tracer().now_ns();
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    ~TraceSpan() {
+        if (active_) {
+            tracer().record({name_, start_ns_, tracer().now_ns() - start_ns_, bytes_});
+        }
+    }
+
+    void set_bytes(uint64_t bytes) noexcept { bytes_ = bytes; }
+
+private:
+    const char* name_;
+    uint64_t bytes_;
+    bool active_;
+    uint64_t start_ns_ = 0;
+};
+
+} // namespace pil
+
+#endif // PIL_TRACE_HPP
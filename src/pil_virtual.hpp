@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_VIRTUAL_HPP
+#define PIL_VIRTUAL_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+
+#include "pil_common.hpp"
+#include "pil_fd.hpp"
+#include "pil_squash.hpp"
+#include "pil_split.hpp"
+
+namespace pil {
+
+// Files assembled on demand from byte ranges of other files: an mbn made of
+// an mdt and its bXX files, or an mdt/bXX set cut out of an mbn. Nothing is
+// converted up front; each read is translated through the layout into reads
+// of the real files.
+
+class VirtualFile {
+public:
+    // Pieces refer to memory with source 0 and to sources[source - 1]
+    // otherwise; they must be disjoint and sorted, bytes outside them read
+    // as zeros
+    VirtualFile(std::vector<uint8_t> memory, std::vector<fs::path> sources,
+                std::vector<ImagePiece> pieces, uint64_t size)
+        : memory_(std::move(memory)), sources_(std::move(sources)),
+          pieces_(std::move(pieces)), size_(size) {}
+
+    uint64_t size() const noexcept { return size_; }
+
+    // Opens every backing file; required before read()
+    void open() {
+        fds_.clear();
+        for (const auto& path : sources_) {
+            auto fd = open_fd(path, O_RDONLY);
+            if (!fd) {
+                throw_system_error(std::format("Failed to open {}", path.string()));
+            }
+            fds_.push_back(std::move(fd));
+        }
+    }
+
+    // pread() semantics: short only at end of file. Safe to call from
+    // several threads at once.
+    size_t read(uint64_t offset, std::span<uint8_t> out) const {
+        if (offset >= size_) {
+            return 0;
+        }
+        out = out.first(static_cast<size_t>(std::min<uint64_t>(out.size(), size_ - offset)));
+        std::ranges::fill(out, 0);
+
+        uint64_t end = offset + out.size();
+        auto it = std::ranges::upper_bound(pieces_, offset, {}, &ImagePiece::offset);
+        if (it != pieces_.begin()) --it;
+
+        for (; it != pieces_.end() && it->offset < end; ++it) {
+            uint64_t from = std::max(offset, it->offset);
+            uint64_t to = std::min(end, it->offset + it->size);
+            if (from >= to) continue;
+
+            auto dest = out.subspan(from - offset, to - from);
+            uint64_t source_offset = it->source_offset + (from - it->offset);
+
+            if (it->source == 0) {
+                std::ranges::copy(std::span{memory_}.subspan(source_offset, dest.size()),
+                                  dest.begin());
+            } else if (read_fd_at(fds_[it->source - 1].get(), source_offset, dest) != dest.size()) {
+                throw Error(std::format("Incomplete read at offset {} of {}", source_offset,
+                                        sources_[it->source - 1].string()));
+            }
+        }
+        return out.size();
+    }
+
+private:
+    std::vector<uint8_t> memory_;
+    std::vector<fs::path> sources_;
+    std::vector<ImagePiece> pieces_;
+    uint64_t size_;
+    std::vector<UniqueFd> fds_;
+};
+
+// The mbn that squash() would build from an mdt and its bXX files
+inline auto virtual_mbn(const fs::path& mdt_path) -> VirtualFile {
+    std::ifstream mdt(mdt_path, std::ios::binary);
+    if (!mdt) {
+        throw_system_error(std::format("Failed to open {}", mdt_path.string()));
+    }
+    mdt.exceptions(std::ios::failbit | std::ios::badbit);
+
+    auto layout = squash_layout(mdt);
+
+    // Source 1 is the mdt itself, then one source per segment in use
+    std::vector<fs::path> sources{mdt_path};
+    std::vector<size_t> source_of(layout.segments.size());
+    for (auto& piece : layout.pieces) {
+        if (piece.source == 0) continue;
+
+        size_t i = piece.source - 1;
+        const auto& segment = layout.segments[i];
+        if (segment.in_mdt) {
+            piece.source = 1;
+            piece.source_offset += segment.mdt_offset;
+            continue;
+        }
+        if (source_of[i] == 0) {
+            sources.push_back(segment_path(mdt_path, i));
+            source_of[i] = sources.size();
+        }
+        piece.source = source_of[i];
+    }
+
+    return VirtualFile(std::move(layout.headers), std::move(sources),
+                       std::move(layout.pieces), layout.size);
+}
+
+struct VirtualSplitFile {
+    std::string name;
+    VirtualFile file;
+};
+
+template<typename ElfHeader, typename ElfPhdr>
+auto virtual_split_impl(std::istream& mbn, const fs::path& mbn_path, const fs::path& mdt_name,
+                        bool is_little_endian) -> std::vector<VirtualSplitFile>
+{
+    auto ehdr = read_elf_header<ElfHeader>(mbn);
+    auto phdrs = read_program_headers<ElfHeader, ElfPhdr>(mbn, ehdr, is_little_endian);
+
+    std::vector<VirtualSplitFile> files;
+
+    auto mdt = build_mdt<ElfHeader, ElfPhdr>(mbn, ehdr, phdrs, is_little_endian);
+    uint64_t mdt_size = mdt.size();
+    files.push_back({mdt_name.string(),
+                     VirtualFile(std::move(mdt), {}, {{0, mdt_size, 0, 0}}, mdt_size)});
+
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        auto [p_offset, p_filesz, p_flags] = get_phdr_info(phdrs[i], is_little_endian);
+
+        if (p_filesz == 0) continue;
+
+        files.push_back({segment_path(mdt_name, i).string(),
+                         VirtualFile({}, {mbn_path}, {{0, p_filesz, 1, p_offset}}, p_filesz)});
+    }
+    return files;
+}
+
+// The mdt and bXX files that split() would cut out of an mbn, named after
+// mdt_name
+inline auto virtual_split(const fs::path& mbn_path, const fs::path& mdt_name)
+    -> std::vector<VirtualSplitFile>
+{
+    std::ifstream mbn(mbn_path, std::ios::binary);
+    if (!mbn) {
+        throw_system_error(std::format("Failed to open {}", mbn_path.string()));
+    }
+    mbn.exceptions(std::ios::failbit | std::ios::badbit);
+
+    auto format = detect_elf_format(mbn);
+    if (format.elf_class == ELFCLASS32) {
+        return virtual_split_impl<Elf32_Ehdr, Elf32_Phdr>(mbn, mbn_path, mdt_name,
+                                                          format.is_little_endian);
+    }
+    return virtual_split_impl<Elf64_Ehdr, Elf64_Phdr>(mbn, mbn_path, mdt_name,
+                                                      format.is_little_endian);
+}
+
+} // namespace pil
+
+#endif // PIL_VIRTUAL_HPP
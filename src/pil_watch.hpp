@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2025, Hao Li
+ */
+#ifndef PIL_WATCH_HPP
+#define PIL_WATCH_HPP
+
+#include <set>
+#include <chrono>
+#include <iostream>
+#include <filesystem>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "pil_squash.hpp"
+
+namespace pil {
+
+// Rewrites just the given segments of an already squashed mbn in place. The
+// mdt must be unchanged since the mbn was built, so the layout still holds.
+// Only the ranges a segment owns in the resolved layout are written, so
+// overlaps come out as a full squash would leave them.
+template<typename ElfHeader, typename ElfPhdr>
+void update_segments_impl(std::istream& mdt, std::ofstream& mbn, const fs::path& mdt_path,
+                          const std::set<size_t>& segments, bool is_little_endian)
+{
+    auto layout = squash_layout_impl<ElfHeader, ElfPhdr>(mdt, is_little_endian);
+
+    // Holes cannot be punched into existing data, so these are plain writes
+    SquashOptions plain;
+    std::vector<uint8_t> data;
+    size_t loaded = 0;
+    for (const auto& piece : layout.pieces) {
+        if (piece.source == 0 || !segments.contains(piece.source - 1)) continue;
+
+        size_t i = piece.source - 1;
+        const auto& s = layout.segments[i];
+        if (s.in_mdt) continue;
+
+        if (loaded != piece.source) {
+            data = read_segment_data(mdt_path, i, s.filesz, plain);
+            loaded = piece.source;
+        }
+        write_file_at(mbn, piece.offset, std::span{data}.subspan(piece.source_offset, piece.size));
+    }
+}
+
+inline void update_segments(const fs::path& mdt_path, const fs::path& mbn_path,
+                            const std::set<size_t>& segments)
+{
+    std::ifstream mdt(mdt_path, std::ios::binary);
+    if (!mdt) {
+        throw_system_error(std::format("Failed to open {}", mdt_path.string()));
+    }
+    mdt.exceptions(std::ios::failbit | std::ios::badbit);
+
+    std::ofstream mbn(mbn_path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!mbn) {
+        throw_system_error(std::format("Failed to open {}", mbn_path.string()));
+    }
+    mbn.exceptions(std::ios::failbit | std::ios::badbit);
+
+    auto format = detect_elf_format(mdt);
+    if (format.elf_class == ELFCLASS32) {
+        update_segments_impl<Elf32_Ehdr, Elf32_Phdr>(mdt, mbn, mdt_path, segments,
+                                                     format.is_little_endian);
+    } else {
+        update_segments_impl<Elf64_Ehdr, Elf64_Phdr>(mdt, mbn, mdt_path, segments,
+                                                     format.is_little_endian);
+    }
+}
+
+// Segment index of a "<stem>.bNN" file name, if it is one of the mdt's
+inline auto segment_of(std::string_view name, std::string_view stem) -> std::optional<size_t> {
+    if (!name.starts_with(stem) || name.size() < stem.size() + 3 ||
+        name.substr(stem.size(), 2) != ".b") {
+        return std::nullopt;
+    }
+
+    size_t index = 0;
+    for (char c : name.substr(stem.size() + 2)) {
+        if (c < '0' || c > '9') return std::nullopt;
+        index = index * 10 + (c - '0');
+    }
+    return index;
+}
+
+constexpr auto WATCH_DEBOUNCE = std::chrono::milliseconds(100);
+
+// Squashes once, then keeps the mbn current: a changed bXX rewrites only
+// that segment's range, a changed mdt re-squashes the whole image. Events
+// are collected until the directory has been quiet for WATCH_DEBOUNCE, so
+// a burst of writes costs one update. The mbn is patched in place, so it
+// must not be a sparse image.
+inline void watch(const fs::path& mdt_path, const fs::path& mbn_path, const SquashOptions& options) {
+#ifdef __linux__
+    auto dir = mdt_path.parent_path().empty() ? fs::path(".") : mdt_path.parent_path();
+    auto mdt_name = mdt_path.filename().string();
+    auto stem = mdt_path.stem().string();
+
+    UniqueFd inotify(::inotify_init1(IN_CLOEXEC));
+    if (!inotify) {
+        throw_system_error("Failed to initialize inotify");
+    }
+    if (::inotify_add_watch(inotify.get(), dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        throw_system_error(std::format("Failed to watch {}", dir.string()));
+    }
+
+    auto timed = [](auto&& step) {
+        auto start = std::chrono::steady_clock::now();
+        step();
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    std::cerr << std::format("Squashed {} in {:.1f} ms, watching for changes\n", mbn_path.string(),
+                             timed([&] { squash(mdt_path, mbn_path, options); }));
+
+    alignas(inotify_event) char buffer[16 * 1024];
+    while (true) {
+        bool mdt_changed = false;
+        std::set<size_t> segments;
+
+        // Block for the first event, then drain until quiet
+        int timeout = -1;
+        while (true) {
+            pollfd pfd{inotify.get(), POLLIN, 0};
+            int ready = ::poll(&pfd, 1, timeout);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready < 0) {
+                throw_system_error("Failed to wait for inotify events");
+            }
+            if (ready == 0) break;
+
+            auto n = ::read(inotify.get(), buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                throw_system_error("Failed to read inotify events");
+            }
+
+            for (char* p = buffer; p < buffer + n; ) {
+                auto event = reinterpret_cast<const inotify_event*>(p);
+                std::string_view name = event->len ? event->name : "";
+                if (name == mdt_name) {
+                    mdt_changed = true;
+                } else if (auto segment = segment_of(name, stem)) {
+                    segments.insert(*segment);
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+
+            if (mdt_changed || !segments.empty()) {
+                timeout = static_cast<int>(WATCH_DEBOUNCE.count());
+            }
+        }
+
+        try {
+            if (mdt_changed) {
+                std::cerr << std::format("mdt changed, re-squashed in {:.1f} ms\n",
+                                         timed([&] { squash(mdt_path, mbn_path, options); }));
+            } else if (!segments.empty()) {
+                auto ms = timed([&] {
+                    update_segments(mdt_path, mbn_path, segments);
+                    write_squash_index(mbn_path, options);
+                });
+                std::string list;
+                for (auto i : segments) {
+                    list += std::format(" {}", i);
+                }
+                std::cerr << std::format("Updated segment{}{} in {:.1f} ms\n",
+                                         segments.size() > 1 ? "s" : "", list, ms);
+            }
+        } catch (const std::exception& e) {
+            // Keep watching; the next save usually fixes whatever broke
+            std::cerr << std::format("Error: {}\n", e.what());
+        }
+    }
+#else
+    (void)mdt_path;
+    (void)mbn_path;
+    (void)options;
+    throw Error("--watch needs inotify, which is only available on Linux");
+#endif
+}
+
+} // namespace pil
+
+#endif // PIL_WATCH_HPP